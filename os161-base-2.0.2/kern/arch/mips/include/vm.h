@@ -113,16 +113,22 @@ paddr_t ram_getfirstfree(void);
 /*
  * TLB shootdown bits.
  *
+ * A shootdown drops the mapping ts_entryhi (page number and pid), or
+ * the whole TLB for TLBSHOOTDOWN_ALL. If ts_done is set it drops
+ * nothing and V()s it instead: as shootdowns run in the order they
+ * were queued, the sender then knows the ones it sent before are done.
+ *
  * We'll take up to 16 invalidations before just flushing the whole TLB.
  */
 
+struct semaphore;
+
 struct tlbshootdown {
-	/*
-	 * Change this to what you need for your VM design.
-	 */
-	int ts_placeholder;
+	uint32_t ts_entryhi;		/* mapping to drop */
+	struct semaphore *ts_done;	/* acknowledgement, or NULL */
 };
 
+#define TLBSHOOTDOWN_ALL 0xffffffff
 #define TLBSHOOTDOWN_MAX 16
 
 
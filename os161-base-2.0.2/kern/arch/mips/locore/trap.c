@@ -39,6 +39,7 @@
 #include <vm.h>
 #include <mainbus.h>
 #include <syscall.h>
+#include "opt-projectc1.h"
 
 
 /* in exception-*.S */
@@ -114,6 +115,18 @@ kill_curthread(vaddr_t epc, unsigned code, vaddr_t vaddr)
 
 	kprintf("Fatal user mode trap %u sig %d (%s, epc 0x%x, vaddr 0x%x)\n",
 		code, sig, trapcodenames[code], epc, vaddr);
+#if OPT_PROJECTC1
+	/*
+	 * A page fault that vm_fault could not satisfy, e.g. with no
+	 * frame and no swap space left for it, only kills the process.
+	 */
+	switch (code) {
+	    case EX_MOD:
+	    case EX_TLBL:
+	    case EX_TLBS:
+		sys__exit_sig(sig);
+	}
+#endif
 	panic("I don't know how to handle this\n");
 }
 
@@ -238,6 +238,25 @@ cpu_irqonoff(void)
         SET_STATUS(xoff);
 }
 
+/*
+ * Cycle counter: c0_count, which the on-chip timer also uses (see
+ * lamebus_machdep.c). $9 == c0_count; we can't use the symbolic name
+ * inside the asm string.
+ */
+uint32_t
+cpu_cycles(void)
+{
+	uint32_t x;
+
+	__asm volatile(
+		".set push;"		/* save assembler mode */
+		".set mips32;"		/* allow MIPS32 registers */
+		"mfc0 %0, $9;"		/* do it */
+		".set pop"		/* restore assembler mode */
+		: "=r" (x));
+	return x;
+}
+
 ////////////////////////////////////////////////////////////
 
 /*
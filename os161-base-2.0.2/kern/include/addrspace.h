@@ -50,7 +50,18 @@ struct vnode *v;
  */
 
 #if OPT_PROJECTC1
-#define MAX_ALLOCATED_PAGES 50 // I limit every process to have a maximum number of pages
+#define MAX_ALLOCATED_PAGES 50 // I limit every process to have a maximum number of pages. This is the initial limit
+#define MIN_ALLOCATED_PAGES 8 // the limit never goes below this
+
+/*
+ * The limit follows the page fault frequency (PFF) of the process. Every PFF_WINDOW page faults
+ * the number of TLB misses of the process since the previous evaluation is taken as the interval:
+ * a short interval means the process needs more frames, a long one that it can give some back.
+ */
+#define PFF_WINDOW 16
+#define PFF_HIGH_INTERVAL 4 // less TLB misses than this per page fault: grow the limit, if there are free frames
+#define PFF_LOW_INTERVAL 64 // more TLB misses than this per page fault: shrink the limit
+#define PFF_STEP 4 // pages added to or removed from the limit at every evaluation
 #endif
 
 struct file_info {
@@ -78,7 +89,13 @@ struct addrspace {
         size_t as_npages2;
         paddr_t as_stackpbase;
 
+        pid_t pid; //owner of the pages of the address space, -1 until its first fault
         int allocated_pages; //number of allocated pages into the RAM for a specific process
+        int max_allocated_pages; //current limit of allocated pages, adapted by the PFF
+        unsigned int pff_clock; //TLB misses of the process, used as its virtual time
+        unsigned int pff_window_start; //pff_clock at the beginning of the current window
+        unsigned int pff_faults; //page faults in the current window
+        int loading; //1 while load_elf() copies the segments in: its writes don't make the pages dirty
         struct file_info fi;
 #endif
 
@@ -143,6 +160,13 @@ int               as_define_stack(struct addrspace *as, vaddr_t *initstackptr);
 
 void as_zero_region(paddr_t paddr, unsigned npages);
 
+#if OPT_PROJECTC1
+#include <pt.h>
+
+paddr_t vm_get_user_frame(struct addrspace *as, pid_t pid);
+int vm_swap_out_victim(entry_t *victim, int index);
+#endif
+
 
 /*
  * Functions in loadelf.c
@@ -2,21 +2,49 @@
 #define _COREMAP_H_
 
 #include <spinlock.h>
+#include <pt.h>
 
 #include "opt-projectc1.h"
 
 #if OPT_PROJECTC1
 
+#define COREMAP_MAX_ORDER 20 // bound of the buddy orders (2^20 frames): the largest one used depends on the RAM
+#define COREMAP_PAGE_CACHE 64 // single frames kept out of the buddy lists
+#define COREMAP_NONE -1 // terminator of the free lists
+
+/* Owner of a frame, in its descriptor */
+#define CM_FREE 0 // in the pool of free frames
+#define CM_KERNEL 1 // allocated by getppages(), or never handed to the pool
+#define CM_USER 2 // holding a user page of the page table
+
+/*
+ * Frame descriptor, one per physical frame, indexed by frame number: the allocator and
+ * the page table share it instead of keeping tables of their own. The resident page
+ * (frame_t, 8 bytes) is in a parallel array, as the victim scans read nothing else;
+ * this part takes 24 bytes.
+ */
+typedef struct coremap_entry {
+    frame_links_t links; //hash chain, fifo queue and swap cache links of the page
+    unsigned int state : 2; //CM_FREE, CM_KERNEL or CM_USER
+    unsigned int block : 30; //frames allocated together, or size of the free block, on the first of them
+} coremap_entry_t;
+
 /* Fault-type arguments to vm_fault() */
 #define VM_FAULT_READ        0    /* A read was attempted */
 #define VM_FAULT_WRITE       1    /* A write was attempted */
 #define VM_FAULT_READONLY    2    /* A write to a readonly page was attempted*/
 
 void coremap_bootstrap(void);
+frame_t *coremap_get_frames(void);
+coremap_entry_t *coremap_get_entries(void);
+unsigned int coremap_get_nframes(void);
 int isTableActive(void);
 int freeppages(paddr_t paddr);
 paddr_t getppages(unsigned long npages);
+int coremap_free_frames_available(void);
+int coremap_free_frames_below(unsigned int n);
 void coremap_destroy(void);
+void coremap_print_stats(void);
 
 /*TLB Structure, top bit of VPN is always zero to indicate User segment*/
 //<----------------20------------------->|<----6---->|<----6---->|
@@ -33,9 +61,17 @@ void coremap_destroy(void);
 //|______________________________________|_______|_______|_______|
 /*Macros for managing attibute bits of a page entry*/
 
+/*Page read from the ELF file: while it is not dirty it can be read again instead of swapped*/
+#define IS_ELF(x) ((x) & 0x00000002)
+#define SET_ELF(x) ((x) | 0x00000002)
+
 #define IS_KERNEL(x) ((x) & 0x00000001)
 #define SET_KERNEL(x) ((x) | 0x00000001)
 
+/*Same bit, for the user pages in the page table: page never written (code)*/
+#define IS_READONLY(x) ((x) & 0x00000001)
+#define SET_READONLY(x) ((x) | 0x00000001)
+
 #define IS_VALID(x) ((x) & 0x00000200)
 #define SET_VALID(x) ((x) | 0x00000200)
 
@@ -45,6 +81,30 @@ void coremap_destroy(void);
 #define ISSWAPPED(x) ((x) & 0x00000080)
 #define SET_SWAPPED(x) ((x) | 0x00000080)
 
+/*Software reference bit, set by vm_fault() and cleared by the clock hand*/
+#define IS_REFERENCED(x) ((x) & 0x00000800)
+#define SET_REFERENCED(x) ((x) | 0x00000800)
+#define CLEAR_REFERENCED(x) ((x) & ~0x00000800)
+
+/*Page of the Am queue of the 2Q replacement: loaded again soon after its eviction*/
+#define IS_HOT(x) ((x) & 0x00001000)
+#define SET_HOT(x) ((x) | 0x00001000)
+
+/*Page read ahead from the swapfile, not referenced yet*/
+#define IS_PREFETCHED(x) ((x) & 0x00002000)
+#define SET_PREFETCHED(x) ((x) | 0x00002000)
+#define CLEAR_PREFETCHED(x) ((x) & ~0x00002000)
+
+/*Page chosen for eviction and being written out: no other thread can choose it*/
+#define IS_PAGEOUT(x) ((x) & 0x00004000)
+#define SET_PAGEOUT(x) ((x) | 0x00004000)
+#define CLEAR_PAGEOUT(x) ((x) & ~0x00004000)
+
+/*Page with an up to date copy in a swap slot (swap cache): mapped read-only until it is written*/
+#define IS_SWAPCACHED(x) ((x) & 0x00008000)
+#define SET_SWAPCACHED(x) ((x) | 0x00008000)
+#define CLEAR_SWAPCACHED(x) ((x) & ~0x00008000)
+
 #endif
 
 #endif /* _COREMAP_H_ */
@@ -0,0 +1,31 @@
+#ifndef _LOADCONTROL_H_
+#define _LOADCONTROL_H_
+
+#include <types.h>
+#include <addrspace.h>
+#include "opt-projectc1.h"
+
+#if OPT_PROJECTC1
+
+/*
+ * Load control: when the global page fault rate says the system is thrashing, processes are
+ * suspended and their whole resident set is swapped out, until the fault rate goes down again.
+ * OS/161 has no priorities: the youngest running process is taken as the lowest priority one.
+ */
+#define LC_HIGH_FAULT_RATE 400 // page faults per second above which a process is suspended
+#define LC_LOW_FAULT_RATE 100 // page faults per second below which a process is resumed
+#define LC_MIN_RUNNING 1 // processes that are never suspended
+
+void loadcontrol_bootstrap(void);
+
+void loadcontrol_register(pid_t pid, struct addrspace *as);
+
+void loadcontrol_unregister(struct addrspace *as);
+
+void loadcontrol_check(pid_t pid, struct addrspace *as);
+
+void loadcontrol_tick(void);
+
+#endif
+
+#endif
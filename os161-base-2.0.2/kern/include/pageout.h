@@ -0,0 +1,24 @@
+#ifndef _PAGEOUT_H_
+#define _PAGEOUT_H_
+
+#include <types.h>
+#include "opt-projectc1.h"
+
+#if OPT_PROJECTC1
+
+/*
+ * Pageout daemon: a kernel thread that keeps some frames free, so that page faults find one
+ * without swapping out a victim themselves. It is woken when the free frames go below the low
+ * watermark, and swaps out victims chosen among all the resident pages until the free frames
+ * are back to the high watermark.
+ */
+#define PAGEOUT_LOW 8 // free frames below which the daemon is woken
+#define PAGEOUT_HIGH 24 // free frames at which the daemon goes back to sleep
+
+void pageout_bootstrap(void);
+
+void pageout_check(void);
+
+#endif
+
+#endif
@@ -70,6 +70,8 @@ struct vnode;
 #define USE_SEMAPHORE_FOR_WAITPID 1
 #endif
 
+#define MAX_PROC 100 /* pids go from 1 to MAX_PROC */
+
 struct proc {
 	char *p_name;			/* Name of this process */
 	struct spinlock p_lock;		/* Lock for this structure */
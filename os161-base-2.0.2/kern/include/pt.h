@@ -4,45 +4,148 @@
 #include <types.h>
 #include "opt-projectc1.h"
 #include <spinlock.h>
+#include <proc.h>
 
 typedef enum { READ_ONLY, READ_WRITE } permission_t;
 
 #if OPT_PROJECTC1
 
+#define PT_NO_ENTRY -1 // terminator of the hash chains and of the fifo queues
+
+#define PT_AGING_FRAMES 32 // frames aged by every hardclock tick
+
+#define PT_2Q_KIN_PERCENT 25 // share of the resident pages kept by the A1in queue of 2Q
+#define PT_SCOPE_GLOBAL -1 // victims chosen among the pages of every process
+
+#define PT_NO_SLOT -1 // frame without a copy in the swap area
+
+#define PT_LOCK_STRIPES 16 // locks of the hash chains, bucket b is covered by lock b % PT_LOCK_STRIPES
+
+struct pt_policy; // victim selection policy, see pt.c
+
+/*
+ * Resident page of a frame, packed in 8 bytes: the part of the frame descriptor read by
+ * the scans of the whole table (aging, global replacement). It has an array of its own,
+ * apart from the rest of the descriptor (see coremap.h), so that the scans read 8 frames
+ * per 64 bytes. Only user pages are in the table, with vaddr < 2GB.
+ */
+typedef struct frame {
+    uint32_t vpn : 20; //virtual page number of the page
+    uint32_t pid : 7; //owner process, PT_NO_PID if the frame holds no user page
+    uint32_t : 5;
+    uint32_t status : 16; //page status bits, see coremap.h
+    uint32_t tlb_index : 6; //TLB slot the page was last loaded in
+    uint32_t : 2;
+    uint32_t age : 8; //aging counter: shifted right on ticks, top bit set if the page was referenced
+} frame_t;
+
+#define PT_NO_PID 127 // owner of the free frames, MAX_PROC must be lower
+
+/*
+ * Links of a frame in the hash chains and in the fifo queues, in the frame descriptor.
+ * They are only followed when the frame is looked up or moved.
+ */
+typedef struct frame_links {
+    int next_hash; //index of the next frame in the same hash chain, PT_NO_ENTRY if it is the last one
+    int fifo_prev; //previous (older) frame of the same process in its fifo queue
+    int fifo_next; //next (younger) frame of the same process in its fifo queue
+    unsigned int load_seq; //sequence number of the load of the page, for the global FIFO
+    int swap_slot; //slot still holding a copy of the page if it is SWAPCACHED, PT_NO_SLOT otherwise
+} frame_links_t;
+
+/* Unpacked copy of a frame descriptor, handed out to the rest of the VM */
 typedef struct entry {
-	vaddr_t vaddr; //virtual address of the page
-	pid_t pid; //process id of the process sharing the page. We don't need to store address space pointer as we can 
+    vaddr_t vaddr; //virtual address of the page
+    pid_t pid; //process id of the owner. We don't need to store address space pointer as we can
     // index into process table using pid and can get the address space by accessing the thread structure.
-	uint32_t status; //page status: Kernel, free, dirty, clean, etc.
+    uint32_t status; //page status: dirty, referenced, etc.
     permission_t permission_flag; // Page can be READ-ONLY or read-write
-    int position_fifo; //used to know when the page was added into the page table
+    int swap_slot; //swap slot with a copy of the page, PT_NO_SLOT if there is none
 } entry_t;
 
+typedef struct fifo {
+    int head; //oldest resident frame of the process, first victim
+    int tail; //youngest resident frame of the process
+    int hand; //clock hand: next frame the replacement looks at, PT_NO_ENTRY to start from the head
+    unsigned int count; //number of resident pages of the process
+} fifo_t;
+
+/* Spinlock of the page table, with its contention counters (updated while holding it) */
+typedef struct pt_lock {
+    struct spinlock lock;
+    unsigned int contended; //times it was found busy
+    unsigned int spins; //iterations spent waiting for it to be released
+    uint32_t since; //cycle counter when the current holder took it
+    uint64_t held; //cycles it has been held, in total
+    uint32_t max_held; //longest single hold, in cycles
+} pt_lock_t;
+
+struct coremap_entry; // frame descriptor, see coremap.h
+struct wchan;
+
 typedef struct table {
-    entry_t * next_entry;
+    frame_t * frames; //resident pages, indexed by frame number, owned by coremap.c
+    struct coremap_entry * coremap; //rest of the frame descriptors, indexed by frame number, owned by coremap.c
     unsigned int length;
-    struct spinlock table_lock;
+    int * hash_anchor; //hash anchor table: for every bucket, index of the first frame of the chain
+    unsigned int hash_size; //number of buckets, always a power of 2
+    fifo_t fifo[MAX_PROC+1]; //resident pages of every process, indexed by pid
+    unsigned int resident; //number of resident pages of all processes
+    unsigned int load_counter; //next load sequence number
+    unsigned int global_hand; //next frame looked at by global replacement
+    unsigned int aging_cursor; //next frame to be aged
+    struct pt_policy *policy; //current victim selection policy
+    int global_scope; //1 if victims can be taken from any process when the RAM is full
+    pt_lock_t table_lock; //frame allocation, fifo queues, policy state
+    pt_lock_t stripe_lock[PT_LOCK_STRIPES]; //hash chains and status bits of the frames in them
+    struct wchan *pageout_wchan[PT_LOCK_STRIPES]; //faults waiting for a page of the stripe being written out
 } table_t;
 
-void lru_update_cnt(void);
-
 void page_table_init(void);
 
-void page_table_add_entry(pid_t pid, vaddr_t vaddr, paddr_t paddr, uint32_t status);
+void page_table_add_entry(pid_t pid, vaddr_t vaddr, paddr_t paddr, uint32_t status, int swap_slot);
 
 int page_table_get_paddr_entry(pid_t pid, vaddr_t vaddr, paddr_t* paddr, uint32_t* status);
 
 void page_table_reset_entry(int i);
 
+int page_table_reset_clean_entry(int i);
+
 void page_table_destroy(void);
 
-int page_table_replacement(pid_t pid, entry_t *entry);
+int page_table_replacement(pid_t pid, int local, entry_t *entry);
 
 void page_table_remove_on_pids(pid_t pid);
 
-unsigned char page_table_get_Status_on_Index(int index); 
+void page_table_set_tlb_index(pid_t pid, vaddr_t vaddr, int tlb_index);
+
+int page_table_mark_referenced(pid_t pid, vaddr_t vaddr, int write);
+
+void page_table_wait_pageout(pid_t pid, vaddr_t vaddr);
+
+void page_table_age_tick(void);
+
+int page_table_set_policy(const char *name);
+
+int page_table_set_scope(const char *scope);
+
+const char *page_table_get_policy_name(void);
 
-void page_table_set_status_at_index(int index, unsigned char val);
+const char *page_table_get_scope_name(void);
+
+void page_table_print_policy_stats(void);
+
+void page_table_print_lock_stats(void);
+
+unsigned int page_table_get_resident(pid_t pid);
+
+int page_table_first_resident(pid_t pid, entry_t *entry);
+
+int page_table_cluster(pid_t pid, vaddr_t vaddr, int max, int cold, entry_t *entries, int *indexes);
+
+void page_table_release(int n, const int *indexes);
+
+unsigned int page_table_get_length(void);
 #endif
 
-#endif
\ No newline at end of file
+#endif
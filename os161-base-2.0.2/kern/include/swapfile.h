@@ -10,12 +10,54 @@
 
 void swap_bootstrap(void);
 
-void swap_out(pid_t pid, vaddr_t vaddr, permission_t permission_flag, paddr_t paddr);
+#define SWAP_CLUSTER 8 // pages written together by a swap out
 
+// write the n pages (n <= SWAP_CLUSTER) in the frames paddrs to consecutive slots, and take them out of the IPT.
+// Clean pages read from the ELF file are dropped, clean pages with a copy in their swap cache slot,
+// and pages all zero, are not written. 0 if they have been taken out, except the ones written while they
+// were evicted without being written to the swap area: those stay in RAM, and their paddrs are set to 0.
+// ENOSPC (or the error extending the swapfile) if none has been written
+int swap_out(int n, const entry_t *pages, paddr_t *paddrs);
+
+// 1 if the page has been loaded from the swapfile, 0 if it is not there, -1 if there is no frame for it
 int swap_in(struct addrspace *as, pid_t pid, vaddr_t vaddr, paddr_t *paddr);
 
+// where a page that is not resident is, for vm_fault()
+#define SWAP_PAGE_NONE 0 // nowhere: it has never been swapped out
+#define SWAP_PAGE_ZERO 1 // it was all zero when it was swapped out: its slot holds no data
+#define SWAP_PAGE_DATA 2 // in the swapfile or in the compressed pool
+int swap_page_state(pid_t pid, vaddr_t vaddr);
+
+// called by the page table when a page with a cached slot is written: its copy is out of date
+void swap_cache_drop(pid_t pid, vaddr_t vaddr, int slot);
+
+// called by the page table when a page read ahead is used (hit = 1) or evicted unused (hit = 0)
+void swap_readahead_feedback(int hit);
+
+unsigned int swap_get_readahead_window(void);
+
+// ghost list of the 2Q replacement: remove returns 1 if (pid, vaddr) was there
+void swap_ghost_add(pid_t pid, vaddr_t vaddr);
+
+int swap_ghost_remove(pid_t pid, vaddr_t vaddr);
+
 void swap_remove_pid(pid_t pid);
 
+// size of the swap area in pages, it can only grow. Returns 0, EINVAL or ENOMEM
+int swap_set_size(unsigned int npages);
+
+unsigned int swap_get_size(void);
+
+unsigned int swap_get_file_size(void);
+
+// backends the slots are striped over: files or raw disk devices (e.g. lhd1raw:), at most 4.
+// Returns 0, EINVAL, EBUSY if slots are in use, or the open error
+int swap_set_devices(int n, char **names);
+
+void swap_print_devices(void);
+
+void swap_print_stats(void);
+
 void swap_destroy(void);
 
 #endif
@@ -95,6 +95,9 @@ int kmalloctest3(int, char **);
 int kmalloctest4(int, char **);
 int nettest(int, char **);
 
+/* project C1 vm benchmarks */
+int vmbench(int, char **);
+
 /* Routine for running a user-level program. */
 int runprogram(char *progname);
 
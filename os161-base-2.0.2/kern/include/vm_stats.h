@@ -1,6 +1,7 @@
 #ifndef _VM_STATS_H_
 #define _VM_STATS_H_
 
+#include <types.h>
 #include "opt-projectc1.h"
 
 #if OPT_PROJECTC1
@@ -17,6 +18,25 @@ extern void increment_page_faults_elf(void);
 extern void increment_page_faults_swapin(void);
 extern void increment_page_faults_swapout(void);
 extern void increment_swapfile_writes(void);
+extern void increment_replacement_second_chances(void);
+extern void increment_replacement_clean_victims(void);
+extern void increment_replacement_dirty_victims(void);
+extern void increment_pff_limit_grows(pid_t pid, int limit);
+extern void increment_pff_limit_shrinks(pid_t pid, int limit);
+extern void increment_pff_frames_released(void);
+extern void increment_loadcontrol_suspensions(void);
+extern void increment_loadcontrol_resumes(void);
+extern void increment_loadcontrol_pages_swapped(void);
+extern void increment_swap_readahead_pages(void);
+extern void increment_swap_readahead_hits(void);
+extern void increment_swap_readahead_wasted(void);
+extern void increment_swap_writes_avoided(void);
+extern void increment_swap_zero_pages(void);
+extern void increment_swap_elf_discards(void);
+extern void increment_zero_frame_mappings(void);
+extern void increment_pageout_wakeups(void);
+extern void increment_pageout_victims(void);
+extern int get_page_faults_disk(void);
 extern void print_all_statistics(void);
 
 #endif
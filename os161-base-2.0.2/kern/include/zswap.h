@@ -0,0 +1,52 @@
+#ifndef _ZSWAP_H_
+#define _ZSWAP_H_
+
+#include <types.h>
+#include <pt.h>
+#include "opt-projectc1.h"
+
+#if OPT_PROJECTC1
+
+/*
+ * Compressed swap tier: evicted pages are compressed into a pool of frames, and go to the
+ * swapfile only if they don't compress well or the pool is full. The frames are taken as the
+ * pages are stored, up to the size of the pool, and given back to the pageout daemon when the
+ * free frames run low. Each frame of the pool is split in chunks, a compressed page takes
+ * consecutive chunks of one frame.
+ */
+#define ZSWAP_POOL_PERCENT 10 // default size of the pool, as a share of the RAM
+#define ZSWAP_CHUNK 128 // bytes, PAGE_SIZE / ZSWAP_CHUNK must be 32
+#define ZSWAP_MAX_LEN (PAGE_SIZE / 2) // pages that don't compress at least this much go to the swapfile
+
+void zswap_bootstrap(void);
+
+// most frames the pool can take, 0 to disable it. EBUSY if the pages stored don't fit in it
+int zswap_set_size(unsigned int nframes);
+
+unsigned int zswap_get_size(void);
+
+// frames taken by the pool
+unsigned int zswap_get_frames(void);
+
+// give back up to n frames of the pool. Returns the number of frames given back
+unsigned int zswap_shrink(unsigned int n);
+
+// compress the page in the frame paddr into the pool. 0, or -1 if it is kept out of it
+int zswap_store(const entry_t *page, paddr_t paddr);
+
+// 1 if the page (pid, vaddr) is in the pool
+int zswap_contains(pid_t pid, vaddr_t vaddr);
+
+// decompress the page (pid, vaddr) into the frame paddr and take it out of the pool. 0, or -1 if it is not there
+int zswap_load(pid_t pid, vaddr_t vaddr, paddr_t paddr, permission_t *permission_flag);
+
+void zswap_remove(pid_t pid, vaddr_t vaddr);
+
+void zswap_remove_pid(pid_t pid);
+
+// swapins: pages swapped in from both tiers, for the hit rate
+void zswap_print_stats(int swapins);
+
+#endif
+
+#endif
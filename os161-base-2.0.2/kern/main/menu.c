@@ -43,6 +43,12 @@
 #include <test.h>
 #include "opt-sfs.h"
 #include "opt-net.h"
+#include "opt-projectc1.h"
+#if OPT_PROJECTC1
+#include <pt.h>
+#include <swapfile.h>
+#include <zswap.h>
+#endif
 
 /*
  * In-kernel menu and command dispatcher.
@@ -251,6 +257,141 @@ cmd_panic(int nargs, char **args)
 	return 0;
 }
 
+#if OPT_PROJECTC1
+/*
+ * Command for choosing the page replacement policy and the scope of
+ * its victims. Give it on the boot command line to run the same
+ * kernel with different policies.
+ */
+static
+int
+cmd_vmpolicy(int nargs, char **args)
+{
+	int result;
+
+	if (nargs < 2 || nargs > 3) {
+		kprintf("Usage: vmpolicy fifo|random|clock|aging|2q [local|global]\n");
+		return EINVAL;
+	}
+
+	result = page_table_set_policy(args[1]);
+	if (result) {
+		kprintf("vmpolicy: unknown policy %s\n", args[1]);
+		return result;
+	}
+	if (nargs == 3) {
+		result = page_table_set_scope(args[2]);
+		if (result) {
+			kprintf("vmpolicy: unknown scope %s\n", args[2]);
+			return result;
+		}
+	}
+
+	kprintf("Page replacement: %s, %s\n", page_table_get_policy_name(),
+		page_table_get_scope_name());
+	return 0;
+}
+
+/*
+ * Command for setting the size of the swap area, in MB. The
+ * swapfile itself grows on demand up to that size. The size can
+ * only be increased.
+ */
+static
+int
+cmd_swapsize(int nargs, char **args)
+{
+	int mb;
+	int result;
+
+	if (nargs > 2) {
+		kprintf("Usage: swapsize [megabytes]\n");
+		return EINVAL;
+	}
+
+	if (nargs == 2) {
+		mb = atoi(args[1]);
+		if (mb <= 0 ||
+		    (unsigned)mb > (unsigned)-1 / (1024 * 1024 / PAGE_SIZE)) {
+			kprintf("swapsize: invalid size %s\n", args[1]);
+			return EINVAL;
+		}
+		result = swap_set_size((unsigned)mb * (1024 * 1024 / PAGE_SIZE));
+		if (result) {
+			kprintf("swapsize: %s\n", strerror(result));
+			return result;
+		}
+	}
+
+	kprintf("Swap area: %u pages, swapfile: %u pages\n",
+		swap_get_size(), swap_get_file_size());
+	return 0;
+}
+
+/*
+ * Command for setting the most frames the compressed swap pool can
+ * take, 0 to disable it. The frames are taken only as pages are
+ * stored in it.
+ */
+static
+int
+cmd_zswapsize(int nargs, char **args)
+{
+	int nframes;
+	int result;
+
+	if (nargs > 2) {
+		kprintf("Usage: zswapsize [frames]\n");
+		return EINVAL;
+	}
+
+	if (nargs == 2) {
+		nframes = atoi(args[1]);
+		if (nframes < 0) {
+			kprintf("zswapsize: invalid size %s\n", args[1]);
+			return EINVAL;
+		}
+		result = zswap_set_size(nframes);
+		if (result) {
+			kprintf("zswapsize: %s\n", strerror(result));
+			return result;
+		}
+	}
+
+	kprintf("Compressed swap pool: %u frames at most, %u taken\n",
+		zswap_get_size(), zswap_get_frames());
+	return 0;
+}
+
+/*
+ * Command for choosing the swap backends: files, or raw disk devices
+ * such as lhd1raw:, written without going through a file system.
+ * Slots are striped over all the backends given. They can be changed
+ * only while nothing is swapped out, so give it on the boot command
+ * line.
+ */
+static
+int
+cmd_swapdev(int nargs, char **args)
+{
+	int result;
+
+	if (nargs > 1) {
+		result = swap_set_devices(nargs - 1, &args[1]);
+		if (result) {
+			kprintf("swapdev: %s\n", strerror(result));
+			if (result == EINVAL) {
+				kprintf("Usage: swapdev [backend...] (at most 4)\n");
+			}
+			return result;
+		}
+	}
+
+	swap_print_devices();
+	return 0;
+}
+#endif
+
 /*
  * Command for shutting down.
  */
@@ -442,6 +583,12 @@ static const char *opsmenu[] = {
 	"[pwd]     Print current directory   ",
 	"[sync]    Sync filesystems          ",
 	"[panic]   Intentional panic         ",
+#if OPT_PROJECTC1
+	"[vmpolicy] Page replacement policy  ",
+	"[swapsize] Size of the swap area    ",
+	"[swapdev] Swap files or raw devices ",
+	"[zswapsize] Compressed swap pool    ",
+#endif
 	"[q]       Quit and shut down        ",
 	NULL
 };
@@ -483,6 +630,9 @@ static const char *testmenu[] = {
 	"[fs4] FS write stress 2             ",
 	"[fs5] FS long stress                ",
 	"[fs6] FS create stress              ",
+#if OPT_PROJECTC1
+	"[vmb] VM page table lookup bench    ",
+#endif
 	NULL
 };
 
@@ -548,6 +698,12 @@ static struct {
 	{ "pwd",	cmd_pwd },
 	{ "sync",	cmd_sync },
 	{ "panic",	cmd_panic },
+#if OPT_PROJECTC1
+	{ "vmpolicy",	cmd_vmpolicy },
+	{ "swapsize",	cmd_swapsize },
+	{ "swapdev",	cmd_swapdev },
+	{ "zswapsize",	cmd_zswapsize },
+#endif
 	{ "q",		cmd_quit },
 	{ "exit",	cmd_quit },
 	{ "halt",	cmd_quit },
@@ -611,6 +767,11 @@ static struct {
 	{ "fs5",	longstress },
 	{ "fs6",	createstress },
 
+#if OPT_PROJECTC1
+	/* project C1 vm benchmarks */
+	{ "vmb",	vmbench },
+#endif
+
 	{ NULL, NULL }
 };
 
@@ -53,7 +53,6 @@
 #if OPT_WAITPID
 #include <synch.h>
 
-#define MAX_PROC 100
 static struct _processTable {
   int active;           /* initial value 0 */
   struct proc *proc[MAX_PROC+1]; /* [0] not used. pids are >= 1 */
@@ -180,6 +179,10 @@ proc_create(const char *name)
 	proc->p_cwd = NULL;
 
 	proc_init_waitpid(proc,name);
+#if OPT_PROJECTC1
+	/* the VM keys its page table and swap entries on this pid */
+	proc->pid = proc->p_pid;
+#endif
 #if OPT_FILE
         bzero(proc->fileTable,OPEN_MAX*sizeof(struct openfile *));
 #endif
@@ -8,6 +8,7 @@
 #include <types.h>
 #include <kern/unistd.h>
 #include <kern/errno.h>
+#include <kern/wait.h>
 #include <clock.h>
 #include <copyinout.h>
 #include <syscall.h>
@@ -22,23 +23,43 @@
 /*
  * system calls for process management
  */
-void
-sys__exit(int status)
+
+/*
+ * Terminate the current process, leaving waitstatus for waitpid.
+ */
+static void
+proc_exit(int waitstatus)
 {
 #if OPT_WAITPID
   struct proc *p = curproc;
-  p->p_status = status & 0xff; /* just lower 8 bits returned */
+  p->p_status = waitstatus;
   proc_remthread(curthread);
   proc_signal_end(p);
 #else
   /* get address space of current process and destroy */
   struct addrspace *as = proc_getas();
   as_destroy(as);
+  (void) waitstatus; // TODO: status handling
 #endif
   thread_exit();
 
   panic("thread_exit returned (should not happen)\n");
-  (void) status; // TODO: status handling
+}
+
+void
+sys__exit(int status)
+{
+  proc_exit(status & 0xff); /* just lower 8 bits returned */
+}
+
+/*
+ * Terminate the current process as killed by signal sig, on a fatal
+ * user mode trap: waitpid sees WIFSIGNALED, with WTERMSIG = sig.
+ */
+void
+sys__exit_sig(int sig)
+{
+  proc_exit(_MKWAIT_SIG(sig));
 }
 
 int
@@ -0,0 +1,116 @@
+/*
+ * Microbenchmarks for the project C1 virtual memory system.
+ *
+ * vmb measures the page table lookup that every TLB miss goes through
+ * in vm_fault(), not a whole fault: for that, time a user workload.
+ * Run it on machines configured with different amounts of RAM (ramsize
+ * in sys161.conf): the cost per lookup should not depend on the number
+ * of frames.
+ *
+ * The fake pages are added marked PAGEOUT, so that no replacement (a
+ * fault with global scope, the pageout daemon) takes them during a run.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <clock.h>
+#include <vm.h>
+#include <pt.h>
+#include <coremap.h>
+#include <test.h>
+
+#define VMBENCH_PID	0		/* never handed out by the process table */
+#define VMBENCH_BASE	0x00400000	/* first fake user page */
+#define VMBENCH_PAGES	64		/* default number of resident pages */
+#define VMBENCH_ROUNDS	64		/* lookups per page */
+
+static
+unsigned long
+vmbench_ns_per_op(const struct timespec *start, const struct timespec *end,
+		  unsigned ops)
+{
+	struct timespec diff;
+	uint64_t ns;
+
+	timespec_sub(end, start, &diff);
+	ns = (uint64_t)diff.tv_sec * 1000000000 + diff.tv_nsec;
+	return ops == 0 ? 0 : (unsigned long)(ns / ops);
+}
+
+int
+vmbench(int nargs, char **args)
+{
+	struct timespec start, end;
+	unsigned long hit_ns, miss_ns;
+	unsigned npages, n, i, r;
+	paddr_t *frames, paddr;
+	uint32_t status;
+
+	npages = VMBENCH_PAGES;
+	if (nargs > 1) {
+		npages = atoi(args[1]);
+	}
+	if (npages == 0) {
+		kprintf("Usage: vmb [npages]\n");
+		return EINVAL;
+	}
+
+	frames = kmalloc(npages * sizeof(paddr_t));
+	if (frames == NULL) {
+		return ENOMEM;
+	}
+
+	/* Make some pages resident on behalf of a fake process */
+	for (n = 0; n < npages; n++) {
+		frames[n] = getppages(1);
+		if (frames[n] == 0) {
+			break;
+		}
+		page_table_add_entry(VMBENCH_PID, VMBENCH_BASE + n*PAGE_SIZE,
+				     frames[n], SET_PAGEOUT(0), PT_NO_SLOT);
+	}
+	if (n == 0) {
+		kfree(frames);
+		kprintf("vmb: no free frames\n");
+		return ENOMEM;
+	}
+
+	/* Lookups of resident pages (TLB reloads) */
+	gettime(&start);
+	for (r = 0; r < VMBENCH_ROUNDS; r++) {
+		for (i = 0; i < n; i++) {
+			if (!page_table_get_paddr_entry(VMBENCH_PID,
+				VMBENCH_BASE + i*PAGE_SIZE, &paddr, &status)) {
+				panic("vmb: resident page not found\n");
+			}
+			KASSERT(paddr == frames[i]);
+		}
+	}
+	gettime(&end);
+	hit_ns = vmbench_ns_per_op(&start, &end, VMBENCH_ROUNDS * n);
+
+	/* Lookups of non resident pages (faults going to ELF/swap) */
+	gettime(&start);
+	for (r = 0; r < VMBENCH_ROUNDS; r++) {
+		for (i = n; i < 2*n; i++) {
+			if (page_table_get_paddr_entry(VMBENCH_PID,
+				VMBENCH_BASE + i*PAGE_SIZE, &paddr, &status)) {
+				panic("vmb: non resident page found\n");
+			}
+		}
+	}
+	gettime(&end);
+	miss_ns = vmbench_ns_per_op(&start, &end, VMBENCH_ROUNDS * n);
+
+	for (i = 0; i < n; i++) {
+		page_table_reset_entry(frames[i] / PAGE_SIZE);
+		freeppages(frames[i]);
+	}
+	kfree(frames);
+
+	kprintf("vmb: %u frames of RAM, %u resident pages\n",
+		page_table_get_length(), n);
+	kprintf("vmb: lookup hit %lu ns, lookup miss %lu ns\n",
+		hit_ns, miss_ns);
+	return 0;
+}
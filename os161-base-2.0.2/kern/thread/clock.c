@@ -37,6 +37,7 @@
 #include "opt-projectc1.h"
 #if OPT_PROJECTC1
 	#include "pt.h"
+	#include "loadcontrol.h"
 #endif
 
 /*
@@ -87,6 +88,11 @@ timerclock(void)
 	spinlock_acquire(&lbolt_lock);
 	wchan_wakeall(lbolt, &lbolt_lock);
 	spinlock_release(&lbolt_lock);
+
+#if OPT_PROJECTC1
+	/* Suspend or resume processes depending on the page fault rate */
+	loadcontrol_tick();
+#endif
 }
 
 /*
@@ -99,10 +105,13 @@ hardclock(void)
 	/*
 	 * Collect statistics here as desired.
 	 */
-	#if OPT_PROJECTC1
-		lru_update_cnt();
-	#endif
 	curcpu->c_hardclocks++;
+#if OPT_PROJECTC1
+	/* Age the page table frames (LRU approximation), on one cpu only */
+	if (curcpu->c_number == 0) {
+		page_table_age_tick();
+	}
+#endif
 	if ((curcpu->c_hardclocks % MIGRATE_HARDCLOCKS) == 0) {
 		thread_consider_migration();
 	}
@@ -1128,11 +1128,32 @@ ipi_broadcast(int code)
 void
 ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping)
 {
-	unsigned n;
+	unsigned n, i;
 
 	spinlock_acquire(&target->c_ipi_lock);
 
 	n = target->c_numshootdown;
+	if (n == TLBSHOOTDOWN_MAX) {
+		/*
+		 * Coalesce: flush the whole TLB first, and keep after it
+		 * only the acknowledgements, which drop nothing.
+		 */
+		for (i=0, n=0; i < TLBSHOOTDOWN_MAX; i++) {
+			if (target->c_shootdown[i].ts_done != NULL) {
+				target->c_shootdown[n++] =
+					target->c_shootdown[i];
+			}
+		}
+		if (n < TLBSHOOTDOWN_MAX) {
+			for (i=n; i > 0; i--) {
+				target->c_shootdown[i] =
+					target->c_shootdown[i-1];
+			}
+			target->c_shootdown[0].ts_entryhi = TLBSHOOTDOWN_ALL;
+			target->c_shootdown[0].ts_done = NULL;
+			n++;
+		}
+	}
 	if (n == TLBSHOOTDOWN_MAX) {
 		/*
 		 * If you have problems with this panic going off,
@@ -1156,6 +1177,30 @@ ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping)
 	spinlock_release(&target->c_ipi_lock);
 }
 
+/*
+ * Send a TLB shootdown IPI to all CPUs but this one. Returns the
+ * number of CPUs it was sent to.
+ */
+unsigned
+ipi_tlbshootdown_broadcast(const struct tlbshootdown *mapping)
+{
+	unsigned i, n = 0;
+	struct cpu *c;
+	int spl;
+
+	/* stay on this cpu */
+	spl = splhigh();
+	for (i=0; i < cpuarray_num(&allcpus); i++) {
+		c = cpuarray_get(&allcpus, i);
+		if (c != curcpu->c_self) {
+			ipi_tlbshootdown(c, mapping);
+			n++;
+		}
+	}
+	splx(spl);
+	return n;
+}
+
 /*
  * Handle an incoming interprocessor interrupt.
  */
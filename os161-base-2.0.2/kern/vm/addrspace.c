@@ -46,6 +46,11 @@
 #include "swapfile.h"
 #include <current.h> //definition of curproc
 #include <cpu.h>
+#include <loadcontrol.h>
+#include <pageout.h>
+#include <zswap.h>
+#include <clock.h>
+#include <spl.h>
 
 #include <opt-projectc1.h>
 
@@ -57,43 +62,42 @@
  * used. The cheesy hack versions in dumbvm.c are used instead.
  */
 
-struct spinlock slock = SPINLOCK_INITIALIZER;
+// frame of zeros mapped read-only by the read faults on pages all zero, 0 if there is none
+static paddr_t vm_zero_frame = 0;
 
-//static struct spinlock freemem_lock = SPINLOCK_INITIALIZER;
+// time between two readings of the clock, for the boot breakdown
+static unsigned long vm_elapsed_us(const struct timespec *start, const struct timespec *end) {
+	struct timespec diff;
 
-static unsigned char *freeRamFrames = NULL;
-static unsigned long *allocSize = NULL;
-static int nRamFrames = 0;
-
-static int allocTableActive = 0;
+	timespec_sub(end, start, &diff);
+	return (unsigned long)diff.tv_sec * 1000000 + diff.tv_nsec / 1000;
+}
 
 void
 vm_bootstrap(void){
 
-	int i;
-	nRamFrames = ((int)ram_getsize())/PAGE_SIZE;  
-	/* alloc freeRamFrame and allocSize */  
-	freeRamFrames = kmalloc(sizeof(unsigned char)*nRamFrames);
-	if (freeRamFrames==NULL) return;  
-	allocSize     = kmalloc(sizeof(unsigned long)*nRamFrames);
-	if (allocSize==NULL) {    
-		/* reset to disable this vm management */
-		freeRamFrames = NULL; return;
-	}
-	for (i=0; i<nRamFrames; i++) {    
-		freeRamFrames[i] = (unsigned char)0;
-		allocSize[i]     = 0;  
-	}
-	spinlock_acquire(&slock);
-	allocTableActive = 1;
-	spinlock_release(&slock);
-	
+	struct timespec t0, t1, t2, t3;
+
+	gettime(&t0);
 	swap_bootstrap();
-	page_table_init();
+	gettime(&t1);
+	/* the page table lives in the frame descriptors of the coremap */
 	coremap_bootstrap();
+	page_table_init();
+	gettime(&t2);
 	tlb_bootstrap();
+	loadcontrol_bootstrap();
+	zswap_bootstrap();
+	vm_zero_frame = getppages(1);
+	if (vm_zero_frame != 0)
+		as_zero_region(vm_zero_frame, 1);
+	pageout_bootstrap();
 	
 	init_stats();
+	gettime(&t3);
+
+	kprintf("vm_bootstrap: swap %lu us, coremap and page table %lu us, the rest %lu us (swapfile %u pages)\n",
+		vm_elapsed_us(&t0, &t1), vm_elapsed_us(&t1, &t2), vm_elapsed_us(&t2, &t3), swap_get_file_size());
 }
 
 static void vm_can_sleep(void){
@@ -147,7 +151,13 @@ struct addrspace *as_create(void){
         as->as_pbase1 = 0;
         as->as_pbase2 = 0;
     #endif
+	as->pid = -1;
 	as->allocated_pages = 0;
+	as->max_allocated_pages = MAX_ALLOCATED_PAGES;
+	as->pff_clock = 0;
+	as->pff_window_start = 0;
+	as->pff_faults = 0;
+	as->loading = 0;
 
 	return as;
 }
@@ -178,8 +188,14 @@ void as_destroy(struct addrspace *as) {
 	  Free the previously allocated addrspace
 	*/
 	//vm_can_sleep();
-	page_table_remove_on_pids(curproc->pid);
-	swap_remove_pid(curproc->pid);
+	// as->pid and not curproc->pid: proc_destroy() runs in the thread that waited for the process
+	if (as->pid != -1) {
+		loadcontrol_unregister(as);
+		page_table_remove_on_pids(as->pid);
+		// no cpu may keep an entry of the pid once it can be given to another process
+		tlb_shootdown_wait();
+		swap_remove_pid(as->pid);
+	}
 	//vfs_close(as->fi.v);
 
 	kfree(as);
@@ -265,20 +281,15 @@ as_define_region(struct addrspace *as, vaddr_t vaddr, size_t sz,
 }
 
 int as_prepare_load(struct addrspace *as) {
-	/*
-	 * Write this.
-	 */
-
-	(void)as;
+	// the segments are copied in with the content vm_fault() reads from the ELF file
+	as->loading = 1;
 	return 0;
 }
 
 int as_complete_load(struct addrspace *as) {
-	/*
-	 * Write this.
-	 */
-
-	(void)as;
+	as->loading = 0;
+	// the entries written by the load are writable: from now on the first write must fault
+	reset_tlb();
 	return 0;
 }
 
@@ -300,10 +311,123 @@ void as_zero_region(paddr_t paddr, unsigned npages)
 	bzero((void *)PADDR_TO_KVADDR(paddr), npages * PAGE_SIZE);
 }
 
-void
-vm_tlbshootdown(const struct tlbshootdown *ts){
-	(void)ts;
-	panic("vm tried to do tlb shootdown?!\n");
+/*
+ * Called on every page fault that needs a frame: at the end of a window, move the limit of
+ * resident pages of the process according to its page fault frequency. It grows only while
+ * there are free frames, and shrinks also when the process is not faulting much but the RAM
+ * is full, to leave frames to the others.
+ */
+static void vm_pff_update(struct addrspace *as, pid_t pid) {
+	unsigned int interval;
+	int free_frames;
+
+	as->pff_faults++;
+	if (as->pff_faults < PFF_WINDOW)
+		return;
+
+	interval = as->pff_clock - as->pff_window_start;
+	free_frames = coremap_free_frames_available();
+
+	if (interval < PFF_WINDOW * PFF_HIGH_INTERVAL) {
+		if (free_frames) {
+			as->max_allocated_pages += PFF_STEP;
+			increment_pff_limit_grows(pid, as->max_allocated_pages);
+			DEBUG(DB_VM, "pff: pid %d limit %d\n", pid, as->max_allocated_pages);
+		}
+	}
+	else if ((interval > PFF_WINDOW * PFF_LOW_INTERVAL || !free_frames) &&
+		 as->max_allocated_pages > MIN_ALLOCATED_PAGES) {
+		as->max_allocated_pages -= PFF_STEP;
+		if (as->max_allocated_pages < MIN_ALLOCATED_PAGES)
+			as->max_allocated_pages = MIN_ALLOCATED_PAGES;
+		increment_pff_limit_shrinks(pid, as->max_allocated_pages);
+		DEBUG(DB_VM, "pff: pid %d limit %d\n", pid, as->max_allocated_pages);
+	}
+
+	as->pff_faults = 0;
+	as->pff_window_start = as->pff_clock;
+}
+
+/*
+ * Swap out the victim in frame index, together with the cold pages that follow it in the
+ * address space of its process, in a single write. The frames of those pages go back to
+ * the free pool. The pages are unmapped while they are written, and faults on them wait
+ * for the write to end. Returns 0, EAGAIN if the victim has been written meanwhile and
+ * stays, or the error of swap_out() if the victim stays in RAM: then it can be chosen
+ * again, like the neighbours.
+ */
+int vm_swap_out_victim(entry_t *victim, int index) {
+	entry_t pages[SWAP_CLUSTER];
+	int indexes[SWAP_CLUSTER];
+	paddr_t paddrs[SWAP_CLUSTER];
+	int n, k, result;
+
+	pages[0] = *victim;
+	indexes[0] = index;
+	n = 1 + page_table_cluster(victim->pid, victim->vaddr, SWAP_CLUSTER - 1, 1, &pages[1], &indexes[1]);
+	for (k = 0; k < n; k++)
+		paddrs[k] = indexes[k] * PAGE_SIZE;
+
+	result = swap_out(n, pages, paddrs);
+	if (result) {
+		page_table_release(n, indexes);
+		return result;
+	}
+	for (k = 1; k < n; k++) {
+		if (paddrs[k] != 0)
+			freeppages(paddrs[k]);
+	}
+	return paddrs[0] == 0 ? EAGAIN : 0;
+}
+
+/*
+ * Get a frame for a page of the process with pid = pid. While the process is under its limit
+ * a free frame is used if there is one, otherwise a victim is chosen by the replacement policy
+ * and swapped out: among the pages of the process once the limit is reached, in the scope of
+ * the policy when the RAM is full. Returns 0 if no frame can be found.
+ */
+paddr_t vm_get_user_frame(struct addrspace *as, pid_t pid) {
+	paddr_t paddr;
+	entry_t victim;
+	int index, local, result;
+
+	// the page table knows the resident pages of the process, including the ones taken by other processes
+	as->allocated_pages = page_table_get_resident(pid);
+	vm_pff_update(as, pid);
+
+	if (as->allocated_pages > as->max_allocated_pages) {
+		// the limit has shrunk: give one frame back to the free pool on every fault
+		index = page_table_replacement(pid, 1, &victim);
+		if (index != -1 && vm_swap_out_victim(&victim, index) == 0) {
+			freeppages(index * PAGE_SIZE);
+			as->allocated_pages--;
+			increment_pff_frames_released();
+		}
+	}
+
+	local = as->allocated_pages >= as->max_allocated_pages;
+
+	if (!local && (paddr = getppages(1)) != 0) {
+		pageout_check();
+		return paddr;
+	}
+	pageout_check();
+
+	do {
+		index = page_table_replacement(pid, local, &victim); // find index victim to replace
+		// with the local scope a process that has no pages yet finds none: the RAM is taken by the
+		// others, whose limits grew while there were free frames, so a victim is taken among them
+		if (index == -1)
+			index = page_table_replacement(PT_SCOPE_GLOBAL, 0, &victim);
+		if (index == -1)
+			return 0;
+		// EAGAIN: the victim has been written while it was evicted, another one is needed
+	} while ((result = vm_swap_out_victim(&victim, index)) == EAGAIN);
+
+	// the swap area is full: the victim stays in RAM, and the fault fails
+	if (result)
+		return 0;
+	return index * PAGE_SIZE;
 }
 
 static int read_elf_page(struct vnode* v_node, paddr_t destPhAdd, size_t len, off_t offset) {
@@ -335,9 +459,7 @@ int vm_fault(int faulttype, vaddr_t faultaddress) { //the goal of this function
 
 	switch (faulttype) {
 	    case VM_FAULT_READONLY:
-		/* We always create pages read-write, so we can't get this */
-			as_destroy(proc_getas());
-			thread_exit();
+		/* Only the pages of the swap cache are mapped read-only: see below */
 	    case VM_FAULT_READ:
 	    case VM_FAULT_WRITE:
 			// Count the fault that has happened
@@ -365,6 +487,8 @@ int vm_fault(int faulttype, vaddr_t faultaddress) { //the goal of this function
 		return EFAULT;
 	}
 
+	as->pff_clock++; // virtual time of the process for the PFF
+
 	/* Assert that the address space has been set up properly. */
 #if OPT_DUMBVM
 	KASSERT(as->as_vbase1 != 0);
@@ -402,49 +526,76 @@ int vm_fault(int faulttype, vaddr_t faultaddress) { //the goal of this function
 	paddr_t paddr_temp;
 	pid_t pid = curproc->pid;
 
+	as->pid = pid;
+	loadcontrol_register(pid, as);
+	loadcontrol_check(pid, as); // sleeps here if the process has been suspended
+
 	int index_tlb = -1;
 	size_t size_to_read;
-	entry_t empty_entry;
-	int index_page_to_replace;
 
 	uint32_t status = 0;
 
-	int result;
+	int result, spl, found;
 
-	if(page_table_get_paddr_entry(pid, faultaddress, &paddr_temp, &status) == 1){
+	if (faulttype == VM_FAULT_READONLY) {
+		if (page_table_get_paddr_entry(pid, faultaddress, &paddr_temp, &status) != 1) {
+			// not resident, so mapped to the shared zero frame: the page gets its own frame now
+			reset_one_entry_by_vaddr(faultaddress | pid << 6);
+			faulttype = VM_FAULT_WRITE;
+		}
+		else if (IS_READONLY(status) && !as->loading) {
+			// a write to a page that really is read-only
+			as_destroy(as);
+			thread_exit();
+		}
+		else {
+			// first write to a page mapped clean: drop the read-only entry, the new one is writable
+			reset_one_entry_by_vaddr(faultaddress | pid << 6);
+		}
+	}
+
+retry:
+	status = 0;
+	found = page_table_get_paddr_entry(pid, faultaddress, &paddr_temp, &status);
+	if(found == 1 && IS_PAGEOUT(status)){
+		// being written out by an eviction: once it is over, the page is in the swap area or released
+		page_table_wait_pageout(pid, faultaddress);
+		goto retry;
+	}
+
+	if(found == 1){
 		// 1 means found
 		paddr = paddr_temp;
 		increment_tlb_reloads(); 
 	}
-	else if(swap_in(as, pid, faultaddress, &paddr_temp) == 1){
+	else if (faulttype == VM_FAULT_READ && vm_zero_frame != 0 &&
+		 ((result = swap_page_state(pid, faultaddress)) == SWAP_PAGE_ZERO ||
+		  (result == SWAP_PAGE_NONE && faultaddress >= stackbase && faultaddress < stacktop))) {
+		// a page all zero that is only read: the shared zero frame, read-only and out of the IPT,
+		// until the first write gives the page its own frame
+		add_entry(&index_tlb, faultaddress | pid << 6, vm_zero_frame | TLBLO_VALID);
+		increment_page_faults_zeroed();
+		increment_zero_frame_mappings();
+		return 0;
+	}
+	else if((result = swap_in(as, pid, faultaddress, &paddr_temp)) != 0){
+		if (result < 0)
+			return ENOMEM;
 		paddr = paddr_temp;
-		status = page_table_get_Status_on_Index(paddr>>12);
+		// SWAPCACHED if swap_in() kept the slot, not if the page was in the compressed pool
+		page_table_get_paddr_entry(pid, faultaddress, &paddr_temp, &status);
 		increment_page_faults_disk();	// The page is uploaded from disk
 	}
 
+
 // On demand page loading begins here
 	else {
 		if (faultaddress >= vbase1 && faultaddress < vtop1) {
 			// Code segment
 
-			if(as->allocated_pages >= MAX_ALLOCATED_PAGES || (paddr = getppages(1)) == 0) { 
-
-                index_page_to_replace = page_table_replacement(pid, &empty_entry); // find index victim to replace
-				index_tlb = page_table_get_Status_on_Index(index_page_to_replace);
-
-                if(index_page_to_replace == -1)
-                    return 0;
-
-                swap_out(pid, empty_entry.vaddr, 
-				empty_entry.permission_flag, 
-				index_page_to_replace * PAGE_SIZE); 
-
-                as->allocated_pages--; 
-                paddr = index_page_to_replace*PAGE_SIZE;
-
-            } 
-			
-            as->allocated_pages++; //increase number of allocated pages for that process
+			paddr = vm_get_user_frame(as, pid);
+			if (paddr == 0)
+				return ENOMEM;
 			increment_page_faults_zeroed();
 			
             // clean the page just got by allocation (or previously swapped)
@@ -476,34 +627,17 @@ int vm_fault(int faulttype, vaddr_t faultaddress) { //the goal of this function
 			increment_page_faults_disk();
 			increment_page_faults_elf();
 
-			status = 0x01; //READONLY
-			if (index_tlb != -1)
-				status |= index_tlb<<2;
-			page_table_add_entry(faultaddress, paddr, pid, status);
+			status = SET_ELF(SET_READONLY(status));
+			page_table_add_entry(pid, faultaddress, paddr, status, PT_NO_SLOT);
 
 			if (result < 0) {}
 				//return -1;
 		}
 		else if (faultaddress >= vbase2 && faultaddress < vtop2) {
 			// Data segment
-			if(as->allocated_pages >= MAX_ALLOCATED_PAGES || (paddr = getppages(1)) == 0) { 
-
-                index_page_to_replace = page_table_replacement(pid, &empty_entry); // find index victim to replace
-				index_tlb = page_table_get_Status_on_Index(index_page_to_replace);
-
-                if(index_page_to_replace == -1)
-                    return 0;
-
-                swap_out(pid, empty_entry.vaddr, 
-				empty_entry.permission_flag, 
-				index_page_to_replace * PAGE_SIZE); 
-
-                as->allocated_pages--; 
-                paddr = index_page_to_replace*PAGE_SIZE;
-
-            } 
-			
-            as->allocated_pages++; //increase number of allocated pages for that process
+			paddr = vm_get_user_frame(as, pid);
+			if (paddr == 0)
+				return ENOMEM;
 			increment_page_faults_zeroed();
 			
             // clean the page just got by allocation (or previously swapped)
@@ -535,41 +669,23 @@ int vm_fault(int faulttype, vaddr_t faultaddress) { //the goal of this function
 			increment_page_faults_disk();
 			increment_page_faults_elf();
 
-			if (index_tlb != -1)
-				status |= index_tlb<<2;
-			page_table_add_entry(faultaddress, paddr, pid, status);
+			status = SET_ELF(status);
+			page_table_add_entry(pid, faultaddress, paddr, status, PT_NO_SLOT);
 
 			if (result < 0){}
 				//return -1;
 		}
 		else if (faultaddress >= stackbase && faultaddress < stacktop) {
 			// Stack 
-			if(as->allocated_pages >= MAX_ALLOCATED_PAGES || (paddr = getppages(1)) == 0) { 
-
-                index_page_to_replace = page_table_replacement(pid, &empty_entry); // find index victim to replace
-				index_tlb = page_table_get_Status_on_Index(index_page_to_replace);
-
-                if(index_page_to_replace == -1)
-                    return 0;
-
-                swap_out(pid, empty_entry.vaddr, 
-				empty_entry.permission_flag, 
-				index_page_to_replace * PAGE_SIZE); 
-
-                as->allocated_pages--; 
-                paddr = index_page_to_replace*PAGE_SIZE;
-
-            } 
-			
-            as->allocated_pages++; //increase number of allocated pages for that process
+			paddr = vm_get_user_frame(as, pid);
+			if (paddr == 0)
+				return ENOMEM;
 			increment_page_faults_zeroed();
 			
             // clean the page just got by allocation (or previously swapped)
             as_zero_region(paddr, 1); 
 
-			if (index_tlb != -1)
-				status |= index_tlb<<2;
-			page_table_add_entry(faultaddress, paddr, pid, status);
+			page_table_add_entry(pid, faultaddress, paddr, status, PT_NO_SLOT);
 
 			if (result < 0){}
 				//return -1;
@@ -584,11 +700,29 @@ int vm_fault(int faulttype, vaddr_t faultaddress) { //the goal of this function
 	KASSERT((paddr & PAGE_FRAME) == paddr);
 	
 	ehi = faultaddress | pid << 6;
-	elo = paddr | TLBLO_DIRTY | TLBLO_VALID;
+	elo = paddr | TLBLO_VALID;
+	// pages are mapped clean until they are written, so that the first write faults and the IPT
+	// knows the page is dirty. Code pages are never writable, but while load_elf() copies them in
+	if (as->loading ? faulttype != VM_FAULT_READ :
+	    !IS_READONLY(status) && (faulttype != VM_FAULT_READ || IS_DIRTY(status)))
+		elo |= TLBLO_DIRTY;
 	
+	// with interrupts off the shootdown of an eviction that marks the page after the check is
+	// only taken after the TLB write, and drops the entry before the page is written out
+	spl = splhigh();
+
+	// The page is being accessed: set its reference bit (and dirty bit on writes) for the replacement
+	if (!page_table_mark_referenced(pid, faultaddress, faulttype != VM_FAULT_READ && !as->loading)) {
+		// chosen as a victim since it was looked up: mapping it would lose the writes to it
+		splx(spl);
+		index_tlb = -1;
+		goto retry;
+	}
+
 	// Write a new entry inside the TLB
 	add_entry(&index_tlb, ehi, elo);
 	KASSERT(index_tlb != -1);
-	page_table_set_status_at_index(paddr>>12, index_tlb<<2);
+	page_table_set_tlb_index(pid, faultaddress, index_tlb);
+	splx(spl);
 	return 0;
 }
@@ -5,35 +5,213 @@
 #include<kern/errno.h>
 #include<coremap.h>
 
-static unsigned char* freeRamFrames = NULL;
-static unsigned long* allocSize = NULL;
+static coremap_entry_t* coremap = NULL; // frame descriptors, shared with the page table
+static frame_t* coremapFrames = NULL; // resident pages of the frames, filled in by the page table
 static int nRamFrames = 0;
 static int allocTableActive = 0;
+static long nFreeFrames = 0; // frames freed and not allocated again
 struct spinlock freemem_lock = SPINLOCK_INITIALIZER;
 struct spinlock stealmem_lock = SPINLOCK_INITIALIZER;
 
+/*
+ * Blocks taken with ram_stealmem() before the coremap exists. Their length is written in
+ * the descriptors at bootstrap, so that freeppages() can give them to the pool later on.
+ */
+#define COREMAP_EARLY_BLOCKS 256
+static struct {
+    paddr_t paddr;
+    unsigned long npages;
+} earlyBlocks[COREMAP_EARLY_BLOCKS];
+static int nEarlyBlocks = 0;
+
+/*
+ * Free frames: a binary buddy allocator for contiguous blocks, with a free list per order
+ * linked through the first frame of each block, whose descriptor holds the block size.
+ * Single frames freed go to the page cache first, a stack served in O(1) that is given
+ * back to the buddy lists when a contiguous allocation cannot be satisfied.
+ */
+static int buddyFree[COREMAP_MAX_ORDER+1]; // first block of every order, COREMAP_NONE if there is none
+static unsigned int buddyBlocks[COREMAP_MAX_ORDER+1]; // free blocks of every order
+static int buddyMaxOrder = 0; // largest order: a single block can cover the whole RAM
+static int pageCache = COREMAP_NONE; // last single frame freed
+static int nPageCache = 0;
+static unsigned int buddySplits = 0;
+static unsigned int buddyMerges = 0;
+static unsigned int pageCacheHits = 0;
+static unsigned int pageCacheDrains = 0;
+
+// links of a free block, written in its first frame
+typedef struct buddy_link {
+    int prev;
+    int next;
+} buddy_link_t;
+
+static buddy_link_t *buddy_link(int frame) {
+    return (buddy_link_t *)PADDR_TO_KVADDR((paddr_t)frame * PAGE_SIZE);
+}
+
+// put the free block of 2^order frames starting at frame in its free list. freemem_lock must be held
+static void buddy_push(int frame, int order) {
+    buddy_link_t *l = buddy_link(frame);
+
+    coremap[frame].state = CM_FREE;
+    coremap[frame].block = 1 << order;
+    l->prev = COREMAP_NONE;
+    l->next = buddyFree[order];
+    if (buddyFree[order] != COREMAP_NONE)
+        buddy_link(buddyFree[order])->prev = frame;
+    buddyFree[order] = frame;
+    buddyBlocks[order]++;
+}
+
+// take the free block starting at frame out of its free list. freemem_lock must be held
+static void buddy_unlink(int frame, int order) {
+    buddy_link_t *l = buddy_link(frame);
+
+    if (l->prev != COREMAP_NONE)
+        buddy_link(l->prev)->next = l->next;
+    else
+        buddyFree[order] = l->next;
+    if (l->next != COREMAP_NONE)
+        buddy_link(l->next)->prev = l->prev;
+    coremap[frame].block = 0;
+    buddyBlocks[order]--;
+}
+
+// free the block of 2^order frames at frame, merging it with its buddy as long as it is free. freemem_lock must be held
+static void buddy_free_block(int frame, int order) {
+    int buddy;
+
+    while (order < buddyMaxOrder) {
+        buddy = frame ^ (1 << order);
+        if (buddy >= nRamFrames || coremap[buddy].state != CM_FREE || coremap[buddy].block != (unsigned int)(1 << order))
+            break;
+        buddy_unlink(buddy, order);
+        if (buddy < frame) {
+            coremap[frame].block = 0;
+            frame = buddy;
+        }
+        order++;
+        buddyMerges++;
+    }
+    buddy_push(frame, order);
+}
+
+/*
+ * Free the np frames starting at first, which need not be a power of 2 nor aligned: they
+ * are given back as the largest aligned blocks that fit. freemem_lock must be held
+ */
+static void buddy_free_run(int first, int np) {
+    int i, order;
+
+    for (i=first; i<first+np; i++) {
+        coremap[i].state = CM_FREE;
+        coremap[i].block = 0;
+    }
+    while (np > 0) {
+        order = 0;
+        while (order < buddyMaxOrder && (first & (1 << order)) == 0 && (2 << order) <= np)
+            order++;
+        buddy_free_block(first, order);
+        first += 1 << order;
+        np -= 1 << order;
+    }
+}
+
+// first frame of np contiguous frames, COREMAP_NONE if no free block is large enough. freemem_lock must be held
+static int buddy_alloc(int np) {
+    int i, frame, order = 0, k;
+
+    while (order <= buddyMaxOrder && (1 << order) < np)
+        order++;
+    for (k=order; k<=buddyMaxOrder && buddyFree[k] == COREMAP_NONE; k++)
+        ;
+    if (k > buddyMaxOrder)
+        return COREMAP_NONE;
+
+    frame = buddyFree[k];
+    buddy_unlink(frame, k);
+    // split it, keeping the lower half, down to the order needed
+    while (k > order) {
+        k--;
+        buddy_push(frame + (1 << k), k);
+        buddySplits++;
+    }
+    for (i=frame; i<frame+(1<<order); i++)
+        coremap[i].state = CM_KERNEL;
+    // the frames beyond np go back at once, so a request is never rounded up
+    if ((1 << order) > np)
+        buddy_free_run(frame + np, (1 << order) - np);
+    return frame;
+}
+
+// give the single frames of the page cache back to the buddy lists, so they can merge. freemem_lock must be held
+static void page_cache_drain(void) {
+    int frame;
+
+    while (pageCache != COREMAP_NONE) {
+        frame = pageCache;
+        pageCache = buddy_link(frame)->next;
+        buddy_free_block(frame, 0);
+    }
+    nPageCache = 0;
+    pageCacheDrains++;
+}
+
 void coremap_bootstrap(void) {
     
-    int i;
+    int i, firstFree;
+    unsigned long npages;
+    paddr_t addr;
+
     nRamFrames = ((int)ram_getsize())/PAGE_SIZE;
-    /* alloc freeRamFrame and allocSize */ 
-    freeRamFrames = kmalloc(sizeof(unsigned char)*nRamFrames);  // created in order to understand if the frame is free or not (char as bool)
-    allocSize = kmalloc(sizeof(unsigned long)*nRamFrames); // Number of consecutive allocated pages
-    if (freeRamFrames == NULL || allocSize == NULL) {
-        /* reset to disable this vm management */ 
-        freeRamFrames = NULL;
-        allocSize = NULL; 
-        panic("[ERR] coremap.c: error creating freeRamFrames or allocSize\n");
-    }
-    for (i=0; i<nRamFrames; i++) {
-        freeRamFrames[i] = (unsigned char)0; 
-        allocSize[i] = 0;
+    /* one descriptor per frame: the page table fills in the page and links when it starts */
+    npages = ((sizeof(frame_t)+sizeof(coremap_entry_t))*nRamFrames + PAGE_SIZE - 1)/PAGE_SIZE;
+    addr = ram_stealmem(npages);
+    if (addr == 0)
+        panic("[ERR] coremap.c: error creating the coremap\n");
+    coremapFrames = (frame_t *)PADDR_TO_KVADDR(addr);
+    coremap = (coremap_entry_t *)(coremapFrames + nRamFrames);
+
+    /* from now on all the memory is the coremap's: ram_stealmem() must not be called again */
+    firstFree = ram_getfirstfree()/PAGE_SIZE;
+    for (i=0; i<firstFree; i++) {
+        coremap[i].state = CM_KERNEL; // kernel image, early allocations, coremap
+        coremap[i].block = 0;
+    }
+    coremap[addr/PAGE_SIZE].block = npages;
+    for (i=0; i<nEarlyBlocks; i++)
+        coremap[earlyBlocks[i].paddr/PAGE_SIZE].block = earlyBlocks[i].npages;
+    for (i=0; i<=COREMAP_MAX_ORDER; i++) {
+        buddyFree[i] = COREMAP_NONE;
+        buddyBlocks[i] = 0;
     }
+    while (buddyMaxOrder < COREMAP_MAX_ORDER && (1 << buddyMaxOrder) < nRamFrames)
+        buddyMaxOrder++;
+    buddy_free_run(firstFree, nRamFrames - firstFree);
+    nFreeFrames = nRamFrames - firstFree;
+
     spinlock_acquire(&freemem_lock);
     allocTableActive = 1;
     spinlock_release(&freemem_lock);
 }
 
+frame_t *coremap_get_frames(void){
+    KASSERT(coremapFrames != NULL);
+    return coremapFrames;
+}
+
+coremap_entry_t *coremap_get_entries(void){
+    KASSERT(coremap != NULL);
+    return coremap;
+}
+
+// frames of the RAM: ram_getsize() no longer works once the coremap has taken them
+unsigned int coremap_get_nframes(void){
+    KASSERT(coremap != NULL);
+    return (unsigned int)nRamFrames;
+}
+
 int isTableActive(void){
 
     int active;
@@ -48,28 +226,31 @@ static paddr_t
 getfreeppages(unsigned long npages){
 
     paddr_t addr;
-    long i, first, found, np = (long)npages;
+    int found, np = (int)npages;
 
     if (!isTableActive())
         return 0;
 
     spinlock_acquire(&freemem_lock);
-    for (i=0, first=found=-1; i<nRamFrames; i++) {
-        if (freeRamFrames[i]) {
-            if (i==0 || !freeRamFrames[i-1])
-                first = i;
-            if (i-first+1 >= np) {
-                found = first;
-                break;
-            }
+    if (np == 1 && pageCache != COREMAP_NONE) {
+        // single frames, mostly for user pages, come from the page cache without touching the buddy lists
+        found = pageCache;
+        pageCache = buddy_link(found)->next;
+        nPageCache--;
+        coremap[found].state = CM_KERNEL;
+        pageCacheHits++;
+    }
+    else {
+        found = buddy_alloc(np);
+        if (found == COREMAP_NONE && nPageCache > 0) {
+            page_cache_drain();
+            found = buddy_alloc(np);
         }
     }
 
-    if (found>=0) {
-        for (i=found; i<found+np; i++) {
-            freeRamFrames[i] = (unsigned char)0;
-        }
-        allocSize[found] = np;
+    if (found != COREMAP_NONE) {
+        nFreeFrames -= np;
+        coremap[found].block = np;
         addr = (paddr_t) found*PAGE_SIZE;
     }
     else {
@@ -82,20 +263,33 @@ getfreeppages(unsigned long npages){
 
 
 int freeppages(paddr_t addr){ 
-    long i, first, np;
+    long first, np;
 
     if (!isTableActive()) 
         return 0; 
     
     first = addr/PAGE_SIZE; 
-    KASSERT(allocSize!=NULL); 
+    KASSERT(coremap!=NULL); 
     KASSERT(nRamFrames>first); 
-    np = allocSize[first];
 
     spinlock_acquire(&freemem_lock); 
     
-    for (i=first; i<first+np; i++) {
-        freeRamFrames[i] = (unsigned char)1;
+    if (coremap[first].state == CM_FREE) {
+        // freed twice
+        spinlock_release(&freemem_lock);
+        return 1;
+    }
+    np = coremap[first].block;
+    nFreeFrames += np;
+    if (np == 1 && nPageCache < COREMAP_PAGE_CACHE) {
+        coremap[first].state = CM_FREE;
+        coremap[first].block = 0;
+        buddy_link(first)->next = pageCache;
+        pageCache = first;
+        nPageCache++;
+    }
+    else if (np > 0) {
+        buddy_free_run(first, np);
     }
     
     spinlock_release(&freemem_lock); 
@@ -104,26 +298,58 @@ int freeppages(paddr_t addr){
 
 paddr_t getppages(unsigned long npages) { 
     paddr_t addr;
-    /* try freed pages first */
+    /* all the memory is in the pool once the coremap is active */
     addr = getfreeppages(npages);
     
-    if (addr == 0) {
-        /* call ram_stealmem */ 
+    if (addr == 0 && !isTableActive()) {
+        /* the coremap is not there yet: call ram_stealmem and remember the block */ 
         spinlock_acquire(&stealmem_lock); 
         addr = ram_stealmem(npages); 
+        if (addr != 0) {
+            // a block left out could never be freed: raise COREMAP_EARLY_BLOCKS instead
+            if (nEarlyBlocks == COREMAP_EARLY_BLOCKS)
+                panic("[ERR] coremap.c: more than %d allocations before the coremap\n", COREMAP_EARLY_BLOCKS);
+            earlyBlocks[nEarlyBlocks].paddr = addr;
+            earlyBlocks[nEarlyBlocks].npages = npages;
+            nEarlyBlocks++;
+        }
         spinlock_release(&stealmem_lock);
     }
     
-    if (addr != 0 && isTableActive()) { 
-        spinlock_acquire(&freemem_lock); 
-        allocSize[addr/PAGE_SIZE] = npages; 
-        spinlock_release(&freemem_lock);
-    }
-    
     return addr;
 }
 
+// 1 if a single frame can still be allocated without replacing a page
+int coremap_free_frames_available(void){
+    return nFreeFrames > 0;
+}
+
+// 1 if fewer than n frames can be allocated without replacing a page
+int coremap_free_frames_below(unsigned int n){
+    return nFreeFrames < (long)n;
+}
+
 void coremap_destroy(void){
-    kfree(freeRamFrames);
-    kfree(allocSize);
-}
\ No newline at end of file
+    /* the descriptors live in frames of their own, which are never given back */
+    spinlock_acquire(&freemem_lock);
+    allocTableActive = 0;
+    spinlock_release(&freemem_lock);
+}
+
+// free blocks per order, and how far the free memory is from being one block
+void coremap_print_stats(void){
+    unsigned int i, largest = 0, inBuddy = 0;
+
+    spinlock_acquire(&freemem_lock);
+    kprintf("COREMAP (buddy, max order %d):\nfree=%ld, page_cache=%d, splits=%u, merges=%u, cache_hits=%u, cache_drains=%u\nfree blocks:",
+        buddyMaxOrder, nFreeFrames, nPageCache, buddySplits, buddyMerges, pageCacheHits, pageCacheDrains);
+    for (i=0; i<=(unsigned int)buddyMaxOrder; i++) {
+        kprintf(" %u:%u", i, buddyBlocks[i]);
+        inBuddy += buddyBlocks[i] << i;
+        if (buddyBlocks[i] > 0)
+            largest = 1 << i;
+    }
+    // share of the free frames of the buddy lists that are not in the largest block
+    kprintf("\nlargest_block=%u, fragmentation=%u%%\n", largest, inBuddy == 0 ? 0 : 100 - largest * 100 / inBuddy);
+    spinlock_release(&freemem_lock);
+}
@@ -0,0 +1,176 @@
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <synch.h>
+#include <vm.h>
+#include <addrspace.h>
+#include <pt.h>
+#include <coremap.h>
+#include <swapfile.h>
+#include <vm_stats.h>
+#include <loadcontrol.h>
+
+typedef struct lc_proc {
+    struct addrspace *as; // NULL if the slot is not used
+    unsigned int birth; // registration order: the highest is the youngest process
+    unsigned int suspend_seq; // suspension order: the lowest is resumed first
+    int suspend; // 1 if the process has to suspend itself at its next fault
+    int suspended; // 1 if the process is sleeping on sem
+    struct semaphore *sem;
+} lc_proc;
+
+static lc_proc procs[MAX_PROC+1]; // indexed by pid
+static unsigned int birth_counter = 0;
+static unsigned int suspend_counter = 0;
+static int last_page_faults = 0; // page faults from disk at the previous tick
+static struct spinlock lc_lock = SPINLOCK_INITIALIZER;
+
+void loadcontrol_bootstrap(void) {
+    int i;
+
+    for(i=0; i<=MAX_PROC; i++) {
+        procs[i].as = NULL;
+        procs[i].suspend = 0;
+        procs[i].suspended = 0;
+        procs[i].sem = NULL;
+    }
+}
+
+// called on the page faults of the process, so that load control knows it is running
+void loadcontrol_register(pid_t pid, struct addrspace *as) {
+    KASSERT(pid >= 0 && pid <= MAX_PROC);
+
+    if (procs[pid].as == as)
+        return;
+
+    // the semaphore of a slot is kept for the next processes with the same pid
+    if (procs[pid].sem == NULL) {
+        procs[pid].sem = sem_create("loadcontrol", 0);
+        if (procs[pid].sem == NULL)
+            return; // the process just cannot be suspended
+    }
+
+    spinlock_acquire(&lc_lock);
+    procs[pid].as = as;
+    procs[pid].birth = birth_counter++;
+    procs[pid].suspend = 0;
+    procs[pid].suspended = 0;
+    spinlock_release(&lc_lock);
+}
+
+void loadcontrol_unregister(struct addrspace *as) {
+    int i;
+
+    spinlock_acquire(&lc_lock);
+    for(i=0; i<=MAX_PROC; i++) {
+        if (procs[i].as == as) {
+            procs[i].as = NULL;
+            procs[i].suspend = 0;
+            break;
+        }
+    }
+    spinlock_release(&lc_lock);
+}
+
+/*
+ * Called at the beginning of every page fault of the process. If load control chose it,
+ * its whole resident set goes to the swapfile in one go and the process sleeps until it
+ * is resumed. Its pages then come back on demand.
+ */
+void loadcontrol_check(pid_t pid, struct addrspace *as) {
+    entry_t pages[SWAP_CLUSTER];
+    int indexes[SWAP_CLUSTER];
+    paddr_t paddrs[SWAP_CLUSTER];
+    int n, k;
+    int suspend;
+
+    spinlock_acquire(&lc_lock);
+    suspend = procs[pid].as == as && procs[pid].suspend;
+    if (suspend)
+        procs[pid].suspended = 1;
+    spinlock_release(&lc_lock);
+
+    if (!suspend)
+        return;
+
+    // the oldest page goes out with the pages that follow it, one write for each run
+    while ((indexes[0] = page_table_first_resident(pid, &pages[0])) != -1) {
+        n = 1 + page_table_cluster(pid, pages[0].vaddr, SWAP_CLUSTER - 1, 0, &pages[1], &indexes[1]);
+        for (k = 0; k < n; k++)
+            paddrs[k] = indexes[k] * PAGE_SIZE;
+        if (swap_out(n, pages, paddrs)) {
+            page_table_release(n, indexes);
+            break; // the swap area is full: the rest of the resident set stays in RAM
+        }
+        for (k = 0; k < n; k++) {
+            if (paddrs[k] == 0)
+                continue; // written meanwhile: it stays, and goes out with the next run
+            freeppages(paddrs[k]);
+            increment_loadcontrol_pages_swapped();
+        }
+    }
+    as->allocated_pages = 0;
+
+    P(procs[pid].sem);
+}
+
+// youngest process still running, -1 if there are no more than LC_MIN_RUNNING. lc_lock must be held
+static int loadcontrol_pick_suspend(void) {
+    int i, victim = -1, running = 0;
+
+    for(i=0; i<=MAX_PROC; i++) {
+        if (procs[i].as == NULL || procs[i].suspend)
+            continue;
+        running++;
+        if (victim == -1 || procs[i].birth > procs[victim].birth)
+            victim = i;
+    }
+    return running > LC_MIN_RUNNING ? victim : -1;
+}
+
+// process suspended first, -1 if there are none. lc_lock must be held
+static int loadcontrol_pick_resume(void) {
+    int i, first = -1;
+
+    for(i=0; i<=MAX_PROC; i++) {
+        if (procs[i].as == NULL || !procs[i].suspend)
+            continue;
+        if (first == -1 || procs[i].suspend_seq < procs[first].suspend_seq)
+            first = i;
+    }
+    return first;
+}
+
+/*
+ * Called once per second by timerclock(): compare the page fault rate of the last second with
+ * the thresholds, and suspend or resume one process.
+ */
+void loadcontrol_tick(void) {
+    int page_faults = get_page_faults_disk();
+    int rate = page_faults - last_page_faults;
+    int i;
+
+    last_page_faults = page_faults;
+
+    spinlock_acquire(&lc_lock);
+    if (rate > LC_HIGH_FAULT_RATE) {
+        i = loadcontrol_pick_suspend();
+        if (i != -1) {
+            procs[i].suspend = 1;
+            procs[i].suspend_seq = suspend_counter++;
+            increment_loadcontrol_suspensions();
+        }
+    }
+    else if (rate < LC_LOW_FAULT_RATE) {
+        i = loadcontrol_pick_resume();
+        if (i != -1) {
+            procs[i].suspend = 0;
+            if (procs[i].suspended) {
+                procs[i].suspended = 0;
+                V(procs[i].sem);
+            }
+            increment_loadcontrol_resumes();
+        }
+    }
+    spinlock_release(&lc_lock);
+}
@@ -0,0 +1,81 @@
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <synch.h>
+#include <thread.h>
+#include <vm.h>
+#include <addrspace.h>
+#include <pt.h>
+#include <coremap.h>
+#include <vm_stats.h>
+#include <pageout.h>
+#include <zswap.h>
+
+static struct semaphore *pageout_sem = NULL; // the daemon sleeps on it
+static int pageout_running = 0; // 1 from a wakeup until the daemon is done
+static struct spinlock pageout_lock = SPINLOCK_INITIALIZER;
+
+static void pageout_thread(void *unused, unsigned long unused2) {
+    entry_t victim;
+    int index, result;
+
+    (void)unused;
+    (void)unused2;
+
+    for(;;) {
+        P(pageout_sem);
+
+        // the frames of the compressed pool that can be packed away cost no write at all
+        zswap_shrink(PAGEOUT_HIGH);
+
+        while (coremap_free_frames_below(PAGEOUT_HIGH)) {
+            index = page_table_replacement(PT_SCOPE_GLOBAL, 0, &victim);
+            if (index == -1)
+                break; // nothing resident: the frames are all taken by the kernel
+            result = vm_swap_out_victim(&victim, index);
+            if (result == EAGAIN)
+                continue; // written meanwhile: it stays, look for another one
+            if (result)
+                break; // the swap area is full: the faults will fail on their own
+            freeppages(index * PAGE_SIZE);
+            increment_pageout_victims();
+        }
+
+        spinlock_acquire(&pageout_lock);
+        pageout_running = 0;
+        spinlock_release(&pageout_lock);
+    }
+}
+
+void pageout_bootstrap(void) {
+    int result;
+
+    pageout_sem = sem_create("pageout", 0);
+    if (pageout_sem == NULL)
+        panic("[ERR] pageout.c: cannot create the semaphore\n");
+
+    result = thread_fork("pageout", NULL, pageout_thread, NULL, 0);
+    if (result)
+        panic("[ERR] pageout.c: cannot start the daemon: %s\n", strerror(result));
+}
+
+// called when a frame is taken from the free pool: wake the daemon if the pool is getting empty
+void pageout_check(void) {
+    int wake = 0;
+
+    if (pageout_sem == NULL || !coremap_free_frames_below(PAGEOUT_LOW))
+        return;
+
+    spinlock_acquire(&pageout_lock);
+    if (!pageout_running) {
+        pageout_running = 1;
+        wake = 1;
+    }
+    spinlock_release(&pageout_lock);
+
+    if (wake) {
+        increment_pageout_wakeups();
+        V(pageout_sem);
+    }
+}
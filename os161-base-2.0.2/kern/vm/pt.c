@@ -1,171 +1,974 @@
 #include <types.h>
+#include <kern/errno.h>
 #include <spinlock.h>
 #include <lib.h>
 #include <pt.h>
 #include <vm.h>
 #include <coremap.h>
+#include <vm_tlb.h>
+#include <vm_stats.h>
+#include <swapfile.h>
+#include <thread.h>
+#include <wchan.h>
+#include <cpu.h>
 
 static table_t * page_table;
 
-void lru_update_cnt(void){
-    unsigned int i;
+/*
+ * Locking. table_lock protects the assignment of the frames to the pages, the fifo queues
+ * and the state of the policies. Each hash chain is protected by the stripe lock of its
+ * bucket, together with the status bits, TLB index and age of the frames linked in it:
+ * the lookups done on every TLB miss and the marking of the reference bits take only one
+ * stripe lock, so faults on different CPUs don't serialize. A frame is linked in or out of
+ * a chain holding both locks, table_lock first. Victim scans read the status bits with
+ * table_lock only: a stale bit can at most make them choose a slightly worse victim.
+ *
+ * The TLB entries dropped here (evictions, aging, pages of other processes) are dropped on
+ * every cpu: reset_one_entry_by_vaddr() sends a shootdown to the others, which can be done
+ * with these spinlocks held. Before a page taken out of the table is read or its frame
+ * reused, tlb_shootdown_wait() makes sure no cpu still maps it.
+ */
+
+/*
+ * Bucket of the hash anchor table for the pair (pid, vaddr).
+ * Pages of the same process are mostly consecutive, so the page number goes in the
+ * low bits as it is, while the pid is spread over the whole word.
+ */
+static unsigned int page_table_hash(pid_t pid, vaddr_t vaddr) {
+    uint32_t key = (vaddr / PAGE_SIZE) ^ ((uint32_t)pid * 0x9e3779b1);
+
+    return key & (page_table->hash_size - 1);
+}
+
+static void page_table_lock(pt_lock_t *l) {
+    unsigned int spins = 0;
+
+    // wait for the lock to look free before trying to take it, counting the iterations
+    while (spinlock_data_get(&l->lock.splk_lock) != 0)
+        spins++;
+    spinlock_acquire(&l->lock);
+    l->since = cpu_cycles();
+    if (spins > 0) {
+        l->contended++;
+        l->spins += spins;
+    }
+}
+
+// account the time l has been held since it was taken. The lock must be held
+static void page_table_lock_held(pt_lock_t *l) {
+    uint32_t held = cpu_cycles() - l->since;
+
+    l->held += held;
+    if (held > l->max_held)
+        l->max_held = held;
+}
+
+static void page_table_unlock(pt_lock_t *l) {
+    page_table_lock_held(l);
+    spinlock_release(&l->lock);
+}
 
-    if (page_table!=NULL){
-        spinlock_acquire(&page_table->table_lock);
-        for (i=0; i<page_table->length; i++){
-            if (page_table->next_entry[i].pid!=-1)
-                page_table->next_entry[i].position_fifo+=1;
+// stripe lock of the chain of (pid, vaddr)
+static pt_lock_t *page_table_stripe(pid_t pid, vaddr_t vaddr) {
+    return &page_table->stripe_lock[page_table_hash(pid, vaddr) % PT_LOCK_STRIPES];
+}
+
+// stripe lock of the chain of the page in frame at position index. Page table lock must be held
+static pt_lock_t *page_table_frame_stripe(int index) {
+    return page_table_stripe(page_table->frames[index].pid, page_table->frames[index].vpn * PAGE_SIZE);
+}
+
+// wake the faults waiting for a page of the stripe to be written out. The stripe lock must be held
+static void page_table_wake_pageout(pt_lock_t *stripe) {
+    wchan_wakeall(page_table->pageout_wchan[stripe - page_table->stripe_lock], &stripe->lock);
+}
+
+// link frame at position index in its chain. Page table lock must be held
+static void page_table_hash_insert(int index) {
+    frame_t *f = &page_table->frames[index];
+    unsigned int bucket = page_table_hash(f->pid, f->vpn * PAGE_SIZE);
+    pt_lock_t *stripe = page_table_frame_stripe(index);
+
+    page_table_lock(stripe);
+    page_table->coremap[index].links.next_hash = page_table->hash_anchor[bucket];
+    page_table->hash_anchor[bucket] = index;
+    page_table_unlock(stripe);
+}
+
+// unlink frame at position index from its chain. Page table lock must be held
+static void page_table_hash_remove(int index) {
+    frame_t *f = &page_table->frames[index];
+    frame_links_t *l = &page_table->coremap[index].links;
+    int *link = &page_table->hash_anchor[page_table_hash(f->pid, f->vpn * PAGE_SIZE)];
+    pt_lock_t *stripe = page_table_frame_stripe(index);
+
+    page_table_lock(stripe);
+    while (*link != PT_NO_ENTRY) {
+        if (*link == index) {
+            *link = l->next_hash;
+            break;
         }
-        spinlock_release(&page_table->table_lock);
+        link = &page_table->coremap[*link].links.next_hash;
     }
+    l->next_hash = PT_NO_ENTRY;
+    page_table_unlock(stripe);
+}
+
+// index of the frame holding (pid, vaddr), PT_NO_ENTRY if not resident. Stripe lock of (pid, vaddr) must be held
+static int page_table_lookup(pid_t pid, vaddr_t vaddr) {
+    int i = page_table->hash_anchor[page_table_hash(pid, vaddr)];
+    uint32_t vpn = vaddr / PAGE_SIZE;
+
+    while (i != PT_NO_ENTRY) {
+        if (page_table->frames[i].pid == pid && page_table->frames[i].vpn == vpn)
+            break;
+        i = page_table->coremap[i].links.next_hash;
+    }
+    return i;
+}
+
+// append frame at position index to the fifo queue of its process. Page table lock must be held
+static void page_table_fifo_enqueue(int index) {
+    frame_links_t *l = &page_table->coremap[index].links;
+    fifo_t *q = &page_table->fifo[page_table->frames[index].pid];
+
+    l->fifo_prev = q->tail;
+    l->fifo_next = PT_NO_ENTRY;
+    if (q->tail != PT_NO_ENTRY)
+        page_table->coremap[q->tail].links.fifo_next = index;
+    else
+        q->head = index;
+    q->tail = index;
+    q->count++;
+    page_table->resident++;
+}
+
+// take frame at position index out of the fifo queue of its process. Page table lock must be held
+static void page_table_fifo_dequeue(int index) {
+    frame_links_t *l = &page_table->coremap[index].links;
+    fifo_t *q = &page_table->fifo[page_table->frames[index].pid];
+
+    if (l->fifo_prev != PT_NO_ENTRY)
+        page_table->coremap[l->fifo_prev].links.fifo_next = l->fifo_next;
+    else
+        q->head = l->fifo_next;
+    if (l->fifo_next != PT_NO_ENTRY)
+        page_table->coremap[l->fifo_next].links.fifo_prev = l->fifo_prev;
+    else
+        q->tail = l->fifo_prev;
+    if (q->hand == index)
+        q->hand = l->fifo_next;
+    q->count--;
+    page_table->resident--;
+    l->fifo_prev = PT_NO_ENTRY;
+    l->fifo_next = PT_NO_ENTRY;
+}
+
+// frame after index in the clock of its process: the queue is walked as a circular list
+static int page_table_clock_next(int index) {
+    if (page_table->coremap[index].links.fifo_next != PT_NO_ENTRY)
+        return page_table->coremap[index].links.fifo_next;
+    return page_table->fifo[page_table->frames[index].pid].head;
+}
+
+/*
+ * Give the page a second chance: clear its reference bit and drop its TLB entry, so
+ * that the next access goes through vm_fault() and sets the bit again.
+ * Stripe lock of the frame must be held
+ */
+static void page_table_clear_referenced(int index) {
+    frame_t *f = &page_table->frames[index];
+
+    f->status = CLEAR_REFERENCED(f->status);
+    reset_one_entry_by_vaddr(f->vpn * PAGE_SIZE | f->pid << 6);
+}
+
+// unpacked copy of the frame at position index. Page table lock must be held
+static void page_table_get_entry(int index, entry_t *entry) {
+    frame_t *f = &page_table->frames[index];
+
+    entry->vaddr = f->vpn * PAGE_SIZE;
+    entry->pid = f->pid;
+    entry->status = f->status;
+    entry->permission_flag = IS_READONLY(f->status) ? READ_ONLY : READ_WRITE;
+    entry->swap_slot = page_table->coremap[index].links.swap_slot;
+}
+
+// clear the entry and take it out of its chain and queue. Page table lock must be held
+static void page_table_clear_entry(int index) {
+    frame_t *f = &page_table->frames[index];
+    pt_lock_t *stripe;
+
+    if (f->pid != PT_NO_PID) {
+        if (IS_PREFETCHED(f->status))
+            swap_readahead_feedback(0);
+        // the TLB must not keep translating to a frame that is going to be reused
+        reset_one_entry_by_vaddr(f->vpn * PAGE_SIZE | f->pid << 6);
+        stripe = page_table_frame_stripe(index);
+        page_table_hash_remove(index);
+        page_table_fifo_dequeue(index);
+        // the page has been written out: the faults waiting for it find it in the swap area now
+        if (IS_PAGEOUT(f->status)) {
+            page_table_lock(stripe);
+            page_table_wake_pageout(stripe);
+            page_table_unlock(stripe);
+        }
+    }
+
+    f->pid = PT_NO_PID;
+    f->vpn = 0;
+    f->status = 0;
+    f->tlb_index = 0;
+    page_table->coremap[index].links.swap_slot = PT_NO_SLOT;
+    // still allocated: it is either reused at once or given back with freeppages()
+    if (page_table->coremap[index].state == CM_USER)
+        page_table->coremap[index].state = CM_KERNEL;
 }
 
 void page_table_init(void) {
 
-    unsigned int length = ram_getsize()/PAGE_SIZE;
+    unsigned int length = coremap_get_nframes();
+    unsigned int hash_size = 1;
     unsigned int i = 0;
 
+    // one bucket per frame at least, so that chains stay short whatever the size of the RAM
+    while (hash_size < length)
+        hash_size <<= 1;
+
     page_table = kmalloc(sizeof(table_t));
     if(page_table == NULL) 
         panic("[ERR] pt.c: error to allocate page table\n");
+    page_table->policy = NULL; // no ticks until the table is ready, see page_table_age_tick()
+
+    // the descriptors of the frames are the coremap's: the page table only fills in its part
+    page_table->frames = coremap_get_frames();
+    page_table->coremap = coremap_get_entries();
 
-    page_table->next_entry = kmalloc(length * sizeof(entry_t));
-    if(page_table->next_entry == NULL)
-        panic("[ERR] pt.c: error to allocate next entry in page table\n");
+    page_table->hash_anchor = kmalloc(hash_size * sizeof(int));
+    if(page_table->hash_anchor == NULL)
+        panic("[ERR] pt.c: error to allocate hash anchor table\n");
 
     page_table->length = (unsigned int)length;
+    page_table->hash_size = hash_size;
     
-    spinlock_init(&page_table->table_lock);
+    spinlock_init(&page_table->table_lock.lock);
+    page_table->table_lock.contended = 0;
+    page_table->table_lock.spins = 0;
+    page_table->table_lock.held = 0;
+    page_table->table_lock.max_held = 0;
+    for(i=0; i<PT_LOCK_STRIPES; i++){
+        page_table->pageout_wchan[i] = wchan_create("pageout");
+        if(page_table->pageout_wchan[i] == NULL)
+            panic("[ERR] pt.c: error to create the pageout wait channels\n");
+        spinlock_init(&page_table->stripe_lock[i].lock);
+        page_table->stripe_lock[i].contended = 0;
+        page_table->stripe_lock[i].spins = 0;
+        page_table->stripe_lock[i].held = 0;
+        page_table->stripe_lock[i].max_held = 0;
+    }
 
-    spinlock_acquire(&page_table->table_lock);
+    page_table_lock(&page_table->table_lock);
     for(i=0; i<length; i++){
-        page_table->next_entry[i].pid = -1;
-        page_table->next_entry[i].vaddr = 0;
-        page_table->next_entry[i].status = 0;
-        page_table->next_entry[i].position_fifo = 0;
+        page_table->frames[i].pid = PT_NO_PID;
+        page_table->frames[i].vpn = 0;
+        page_table->frames[i].status = 0;
+        page_table->frames[i].tlb_index = 0;
+        page_table->frames[i].age = 0;
+        page_table->coremap[i].links.next_hash = PT_NO_ENTRY;
+        page_table->coremap[i].links.fifo_prev = PT_NO_ENTRY;
+        page_table->coremap[i].links.fifo_next = PT_NO_ENTRY;
+        page_table->coremap[i].links.load_seq = 0;
+        page_table->coremap[i].links.swap_slot = PT_NO_SLOT;
+    }
+    for(i=0; i<hash_size; i++){
+        page_table->hash_anchor[i] = PT_NO_ENTRY;
     }
-    spinlock_release(&page_table->table_lock);
+    for(i=0; i<=MAX_PROC; i++){
+        page_table->fifo[i].head = PT_NO_ENTRY;
+        page_table->fifo[i].tail = PT_NO_ENTRY;
+        page_table->fifo[i].hand = PT_NO_ENTRY;
+        page_table->fifo[i].count = 0;
+    }
+    page_table->resident = 0;
+    page_table->load_counter = 0;
+    page_table->global_hand = 0;
+    page_table->aging_cursor = 0;
+    page_table->global_scope = 0;
+    page_table_unlock(&page_table->table_lock);
+
+    page_table_set_policy("aging");
 }
 
-void page_table_add_entry(pid_t pid, vaddr_t vaddr, paddr_t paddr, uint32_t status) { 
+/*
+ * The page at vaddr of process pid is now in the frame at paddr. swap_slot is the slot it has
+ * just been read from, kept as its swap cache, or PT_NO_SLOT.
+ */
+void page_table_add_entry(pid_t pid, vaddr_t vaddr, paddr_t paddr, uint32_t status, int swap_slot) { 
     
-    unsigned int i;
-    int last_position_fifo = -1;
     unsigned int frame_index = (int) paddr >> 12;
     
     KASSERT(frame_index < page_table->length);
+    KASSERT(pid >= 0 && pid <= MAX_PROC);
+    KASSERT(vaddr < MIPS_KSEG0);
+
+    // a page evicted from A1in not long ago goes directly in Am
+    if (swap_ghost_remove(pid, vaddr))
+        status = SET_HOT(status);
+    if (swap_slot != PT_NO_SLOT)
+        status = SET_SWAPCACHED(status);
     
-    spinlock_acquire(&page_table->table_lock);
-    for(i=0; i<page_table->length; i++){
-        if(pid == page_table->next_entry[i].pid && page_table->next_entry[i].position_fifo > last_position_fifo)
-            last_position_fifo = page_table->next_entry[i].position_fifo;
-    }
-    page_table->next_entry[frame_index].pid = pid;
-    page_table->next_entry[frame_index].vaddr = vaddr;
-    page_table->next_entry[frame_index].status = status;
-    page_table->next_entry[frame_index].position_fifo = last_position_fifo + 1;
-    spinlock_release(&page_table->table_lock);
+    page_table_lock(&page_table->table_lock);
+    page_table_clear_entry(frame_index);
+    page_table->frames[frame_index].pid = pid;
+    page_table->frames[frame_index].vpn = vaddr / PAGE_SIZE;
+    page_table->frames[frame_index].status = status;
+    // it is being referenced right now, unless it has been read ahead
+    page_table->frames[frame_index].age = IS_PREFETCHED(status) ? 0 : 0x80;
+    page_table->coremap[frame_index].links.load_seq = page_table->load_counter++;
+    page_table->coremap[frame_index].links.swap_slot = swap_slot;
+    page_table->coremap[frame_index].state = CM_USER;
+    page_table_hash_insert(frame_index);
+    page_table_fifo_enqueue(frame_index); // the youngest page goes at the tail
+    page_table_unlock(&page_table->table_lock);
 }
 
 int page_table_get_paddr_entry(pid_t pid, vaddr_t vaddr, paddr_t* paddr, uint32_t* status) { 
-    unsigned int i = 0, last = page_table->length;
-    int result;
-    entry_t e;
-
-    spinlock_acquire(&page_table->table_lock);
-
-    for(i=0; i<page_table->length; i++)
-    {
-        e = page_table->next_entry[i];
-        if(e.pid == pid && e.vaddr == vaddr)
-        {
-            last = i;
+    int i;
+    int result = 0;
+    pt_lock_t *stripe = page_table_stripe(pid, vaddr);
+
+    page_table_lock(stripe);
+    i = page_table_lookup(pid, vaddr);
+    if(i != PT_NO_ENTRY) {
+        *paddr = i * PAGE_SIZE;
+        *status = page_table->frames[i].status;
+        result = 1;
+    }
+    page_table_unlock(stripe);
+
+    return result;
+}
+
+/*
+ * Scans of the victim policies. The scope is either the pid of a process, whose resident
+ * pages are walked as a circular list starting from its hand, or PT_SCOPE_GLOBAL, where
+ * every resident page is walked in frame order starting from the global hand.
+ * Page table lock must be held by all of them
+ */
+
+// first resident frame from index on, the table is seen as circular
+static int page_table_next_resident(unsigned int index) {
+    unsigned int n;
+
+    for(n=0; n<page_table->length; n++, index++){
+        if (index >= page_table->length)
+            index = 0;
+        if (page_table->frames[index].pid != PT_NO_PID)
+            return index;
+    }
+    return PT_NO_ENTRY;
+}
+
+static unsigned int page_table_scope_size(pid_t scope) {
+    if (scope == PT_SCOPE_GLOBAL)
+        return page_table->resident;
+    return page_table->fifo[scope].count;
+}
+
+static int page_table_scope_first(pid_t scope) {
+    fifo_t *q;
+
+    if (scope == PT_SCOPE_GLOBAL)
+        return page_table->resident == 0 ? PT_NO_ENTRY : page_table_next_resident(page_table->global_hand);
+    q = &page_table->fifo[scope];
+    return q->hand != PT_NO_ENTRY ? q->hand : q->head;
+}
+
+static int page_table_scope_next(pid_t scope, int index) {
+    if (scope == PT_SCOPE_GLOBAL)
+        return page_table_next_resident(index + 1);
+    return page_table_clock_next(index);
+}
+
+// 1 if the frame is already being swapped out, by a fault or by the pageout daemon
+static int page_table_busy(int index) {
+    return IS_PAGEOUT(page_table->frames[index].status);
+}
+
+/*
+ * Take the frame out of the candidates of every other eviction, until it is reset or released,
+ * and unmap it while it is written out: the next access faults, and the fault waits for the
+ * write to end (page_table_wait_pageout()). Stripe lock of the frame must be held
+ */
+static void page_table_mark_pageout(int index) {
+    frame_t *f = &page_table->frames[index];
+
+    f->status = SET_PAGEOUT(f->status);
+    reset_one_entry_by_vaddr(f->vpn * PAGE_SIZE | f->pid << 6);
+}
+
+static void page_table_set_pageout(int index) {
+    pt_lock_t *stripe = page_table_frame_stripe(index);
+
+    page_table_lock(stripe);
+    page_table_mark_pageout(index);
+    page_table_unlock(stripe);
+}
+
+
+// FIFO: the oldest page. Locally it is the head of the queue, globally the lowest load sequence number
+static int page_table_victim_fifo(pid_t scope, unsigned int *examined) {
+    int index_replacement = PT_NO_ENTRY;
+    unsigned int k, n = page_table_scope_size(scope);
+    int i;
+
+    if (scope != PT_SCOPE_GLOBAL) {
+        *examined = 0;
+        for(i = page_table->fifo[scope].head; i != PT_NO_ENTRY; i = page_table->coremap[i].links.fifo_next) {
+            (*examined)++;
+            if (!page_table_busy(i))
+                break;
         }
+        return i;
     }
-    spinlock_release(&page_table->table_lock);
 
-    if(last == page_table->length) {
-        result = 0;
+    i = page_table_scope_first(scope);
+    for(k=0; k<n; k++) {
+        if (page_table_busy(i))
+            ;
+        else if (index_replacement == PT_NO_ENTRY ||
+            page_table->coremap[i].links.load_seq - page_table->coremap[index_replacement].links.load_seq > 0x80000000)
+            index_replacement = i;
+        i = page_table_scope_next(scope, i);
     }
-    else {
-        *paddr = last * PAGE_SIZE;
-        *status = page_table->next_entry[last].status;
-        result = 1;
+    *examined = n;
+    return index_replacement;
+}
+
+// random: any page of the scope, with the same probability
+static int page_table_victim_random(pid_t scope, unsigned int *examined) {
+    unsigned int k, n = page_table_scope_size(scope);
+    int i;
+
+    if (n == 0)
+        return PT_NO_ENTRY;
+
+    i = page_table_scope_first(scope);
+    for(k=random() % n; k>0; k--)
+        i = page_table_scope_next(scope, i);
+    // if it is being swapped out already, the next free one
+    for(k=1; page_table_busy(i); k++) {
+        if (k == n)
+            return PT_NO_ENTRY;
+        i = page_table_scope_next(scope, i);
     }
-    return result;
+    *examined = k;
+    return i;
 }
 
-int page_table_replacement(pid_t pid, entry_t *entry){ 
-    //local page table replacement. I choose the oldest page for a process with pid = pid
-    unsigned int i;
-    int index_replacement = -1;
-
-    for(i=0; i<page_table->length; i++) {
-        if(page_table->next_entry[i].position_fifo == 0 && page_table->next_entry[i].pid == pid) {
-            entry->pid = page_table->next_entry[i].pid;
-            entry->permission_flag = page_table->next_entry[i].permission_flag;
-            entry->vaddr = page_table->next_entry[i].vaddr;
-            entry->status = page_table->next_entry[i].status;
-            entry->position_fifo = page_table->next_entry[i].position_fifo;
+/*
+ * Enhanced second chance (clock). Starting from the hand:
+ *  - pass 0 looks for a page neither referenced nor dirty;
+ *  - pass 1 accepts any page not referenced, clearing the reference bits it goes over;
+ *  - passes 2 and 3 repeat 0 and 1, when every reference bit has been cleared.
+ * So clean victims are preferred, and the search always ends within four turns.
+ */
+static int page_table_victim_clock(pid_t scope, unsigned int *examined) {
+    int index_replacement = PT_NO_ENTRY;
+    unsigned int k, n = page_table_scope_size(scope);
+    int i, pass;
+    frame_t *f;
+    pt_lock_t *stripe;
+
+    i = page_table_scope_first(scope);
+    *examined = 0;
+
+    for(pass=0; n > 0 && pass<4 && index_replacement == PT_NO_ENTRY; pass++) {
+        for(k=0; k<n; k++) {
+            f = &page_table->frames[i];
+            (*examined)++;
+            if(page_table_busy(i))
+                ;
+            else if(!IS_REFERENCED(f->status)) {
+                if(pass % 2 == 1 || !IS_DIRTY(f->status)) {
+                    index_replacement = i;
+                    break;
+                }
+            }
+            else if(pass % 2 == 1) {
+                stripe = page_table_frame_stripe(i);
+                page_table_lock(stripe);
+                page_table_clear_referenced(i);
+                page_table_unlock(stripe);
+                increment_replacement_second_chances();
+            }
+            i = page_table_scope_next(scope, i);
+        }
+    }
+
+    return index_replacement;
+}
+
+/*
+ * Tick of the policies that choose by age: shift the age of the next PT_AGING_FRAMES frames,
+ * moving the reference bit into the top bit of the age. The bit is then cleared together with
+ * the TLB entry, so the next access sets it again. The whole table is aged every
+ * length/PT_AGING_FRAMES ticks, and no tick keeps the lock for more than a few frames.
+ * The other policies skip it: fifo and random never look at the bit, and clock clears it
+ * itself as its hand passes, so clearing it here would only cost TLB misses.
+ */
+static void page_table_age_frames(void){
+    unsigned int n;
+    frame_t *f;
+    pt_lock_t *stripe;
+
+    page_table_lock(&page_table->table_lock);
+    for(n=0; n<PT_AGING_FRAMES && n<page_table->length; n++){
+        f = &page_table->frames[page_table->aging_cursor];
+        if (f->pid != PT_NO_PID) {
+            stripe = page_table_frame_stripe(page_table->aging_cursor);
+            page_table_lock(stripe);
+            f->age >>= 1;
+            if (IS_REFERENCED(f->status)) {
+                f->age |= 0x80;
+                page_table_clear_referenced(page_table->aging_cursor);
+            }
+            page_table_unlock(stripe);
+        }
+        page_table->aging_cursor = (page_table->aging_cursor + 1) % page_table->length;
+    }
+    page_table_unlock(&page_table->table_lock);
+}
+
+/*
+ * Aging approximation of LRU: the victim is the page with the lowest age. The scan
+ * stops at the first page that has not been referenced for 8 ticks, as no page can be
+ * older than that.
+ */
+static int page_table_victim_aging(pid_t scope, unsigned int *examined) {
+    int index_replacement = PT_NO_ENTRY;
+    unsigned int k, n = page_table_scope_size(scope);
+    int i;
+    frame_t *f;
+
+    i = page_table_scope_first(scope);
+    for(k=0; k<n; k++) {
+        f = &page_table->frames[i];
+        if (page_table_busy(i))
+            ;
+        else if (index_replacement == PT_NO_ENTRY || f->age < page_table->frames[index_replacement].age) {
             index_replacement = i;
-            break;
+            if (f->age == 0) {
+                k++;
+                break;
+            }
         }
+        i = page_table_scope_next(scope, i);
     }
+    *examined = k;
+
+    return index_replacement;
+}
+
+/*
+ * 2Q: pages loaded for the first time are in A1in, pages loaded again while their (pid, vaddr)
+ * is in the ghost list A1out (see swapfile.c) are in Am, marked HOT. While A1in holds more than
+ * PT_2Q_KIN_PERCENT of the pages its oldest page is the victim, and is remembered in A1out;
+ * otherwise the victim is the least recently used page of Am, by age. The one-touch pages of a
+ * sequential scan only recycle A1in, and never push out the working set in Am.
+ */
+static int page_table_victim_2q(pid_t scope, unsigned int *examined) {
+    int oldest_in = PT_NO_ENTRY, lru_hot = PT_NO_ENTRY;
+    unsigned int k, n_in = 0, n = page_table_scope_size(scope);
+    int i;
+    frame_t *f;
+
+    i = page_table_scope_first(scope);
+    for(k=0; k<n; k++) {
+        f = &page_table->frames[i];
+        if (page_table_busy(i))
+            ;
+        else if (IS_HOT(f->status)) {
+            if (lru_hot == PT_NO_ENTRY || f->age < page_table->frames[lru_hot].age)
+                lru_hot = i;
+        }
+        else {
+            n_in++;
+            if (oldest_in == PT_NO_ENTRY ||
+                page_table->coremap[i].links.load_seq - page_table->coremap[oldest_in].links.load_seq > 0x80000000)
+                oldest_in = i;
+        }
+        i = page_table_scope_next(scope, i);
+    }
+    *examined = n;
+
+    if (oldest_in != PT_NO_ENTRY && (lru_hot == PT_NO_ENTRY || n_in * 100 > n * PT_2Q_KIN_PERCENT)) {
+        swap_ghost_add(page_table->frames[oldest_in].pid, page_table->frames[oldest_in].vpn * PAGE_SIZE);
+        return oldest_in;
+    }
+    return lru_hot;
+}
+
+struct pt_policy {
+    const char *name;
+    int (*victim)(pid_t scope, unsigned int *examined); // victim in the scope, page table lock held
+    void (*tick)(void); // called on every hardclock, NULL if the policy needs no ticks
+    unsigned int decisions; // number of victims chosen
+    unsigned int examined; // number of frames looked at to choose them
+};
+
+static struct pt_policy policies[] = {
+    { "fifo",   page_table_victim_fifo,   NULL,                  0, 0 },
+    { "random", page_table_victim_random, NULL,                  0, 0 },
+    { "clock",  page_table_victim_clock,  NULL,                  0, 0 },
+    { "aging",  page_table_victim_aging,  page_table_age_frames, 0, 0 },
+    { "2q",     page_table_victim_2q,     page_table_age_frames, 0, 0 },
+};
+
+#define PT_NPOLICIES (sizeof(policies) / sizeof(policies[0]))
+
+/*
+ * Choose a victim for a page fault of the process with pid = pid, according to the current policy.
+ * The victim is searched among the pages of the process if local is set or the scope is local,
+ * among all the resident pages otherwise, or if pid is PT_SCOPE_GLOBAL (pageout daemon).
+ * The victim is marked PAGEOUT: it is not chosen again until it is reset or released.
+ */
+int page_table_replacement(pid_t pid, int local, entry_t *entry){ 
+    int index_replacement;
+    unsigned int examined = 0;
+    pid_t scope;
+    struct pt_policy *policy;
+
+    KASSERT(pid == PT_SCOPE_GLOBAL || (pid >= 0 && pid <= MAX_PROC));
+
+    page_table_lock(&page_table->table_lock);
+    policy = page_table->policy;
+    if (pid == PT_SCOPE_GLOBAL)
+        scope = PT_SCOPE_GLOBAL;
+    else
+        scope = (local || !page_table->global_scope) ? pid : PT_SCOPE_GLOBAL;
+    index_replacement = policy->victim(scope, &examined);
+
+    policy->examined += examined;
+    if (index_replacement != PT_NO_ENTRY) {
+        page_table_set_pageout(index_replacement);
+        page_table_get_entry(index_replacement, entry);
+        if (scope == PT_SCOPE_GLOBAL)
+            page_table->global_hand = (index_replacement + 1) % page_table->length;
+        else
+            page_table->fifo[pid].hand = page_table_clock_next(index_replacement);
+        policy->decisions++;
+        if (IS_DIRTY(entry->status))
+            increment_replacement_dirty_victims();
+        else
+            increment_replacement_clean_victims();
+    }
+    page_table_unlock(&page_table->table_lock);
 
     return index_replacement;   // if -1 is returned, then no index has been found
 }
 
 void page_table_reset_entry(int index) {
-    unsigned int i;
-    pid_t pid = page_table->next_entry[index].pid;
-    int position_fifo = page_table->next_entry[index].position_fifo;
+    page_table_lock(&page_table->table_lock);
+    page_table_clear_entry(index);
+    page_table_unlock(&page_table->table_lock);
+}
 
-    spinlock_acquire(&page_table->table_lock);
-    page_table->next_entry[index].pid = -1;
-    page_table->next_entry[index].vaddr = 0;
-    page_table->next_entry[index].status = 0;
-    page_table->next_entry[index].position_fifo = 0;
+/*
+ * Reset the entry of a page evicted clean, unless it has been written since it was chosen:
+ * then it stays, and it can be chosen again. 1 if the entry has been reset
+ */
+int page_table_reset_clean_entry(int index) {
+    pt_lock_t *stripe;
+    int dirty;
 
-    for(i=0; i<page_table->length; i++){
-        if(pid == page_table->next_entry[i].pid && page_table->next_entry[i].position_fifo > position_fifo)
-            page_table->next_entry[i].position_fifo--;
+    page_table_lock(&page_table->table_lock);
+    stripe = page_table_frame_stripe(index);
+    page_table_lock(stripe);
+    dirty = IS_DIRTY(page_table->frames[index].status);
+    if (dirty) {
+        page_table->frames[index].status = CLEAR_PAGEOUT(page_table->frames[index].status);
+        page_table_wake_pageout(stripe);
     }
-    spinlock_release(&page_table->table_lock);
+    page_table_unlock(stripe);
+    if (!dirty)
+        page_table_clear_entry(index);
+    page_table_unlock(&page_table->table_lock);
+
+    return !dirty;
 }
 
 void page_table_remove_on_pids(pid_t pid){
-    unsigned int i;
+    int i, next, busy;
 
-    if (pid < 0){
+    if (pid < 0 || pid > MAX_PROC){
         panic("error on pid: it is invalid\n");
     }
 
-    // do it in mutual exclusion
-    spinlock_acquire(&page_table->table_lock);
-    for(i = 0; i < page_table->length; i++){
-        if(page_table->next_entry[i].pid == pid){
-            page_table_reset_entry(i);
+    do {
+        busy = 0;
+        // do it in mutual exclusion. Only the resident pages of the process are visited
+        page_table_lock(&page_table->table_lock);
+        for(i = page_table->fifo[pid].head; i != PT_NO_ENTRY; i = next){
+            next = page_table->coremap[i].links.fifo_next;
+            if (page_table_busy(i)) {
+                busy = 1;
+                continue;
+            }
+            page_table_clear_entry(i);
             freeppages(i * PAGE_SIZE);
         }
-    }
-    spinlock_release(&page_table->table_lock);
+        page_table_unlock(&page_table->table_lock);
+
+        // another thread is writing some pages to the swapfile: their slots must exist before
+        // swap_remove_pid() is called, so wait for it to end
+        if (busy)
+            thread_yield();
+    } while (busy);
 }
 
 void page_table_destroy(void) {
-    unsigned int i = 0;
-    unsigned int len = page_table->length;
-    spinlock_acquire(&page_table->table_lock);    
-    for(i=0; i < len; i++) {
-        kfree((void*)&page_table->next_entry[i]);
+    unsigned int i;
+
+    for(i=0; i<PT_LOCK_STRIPES; i++) {
+        wchan_destroy(page_table->pageout_wchan[i]);
+        spinlock_cleanup(&page_table->stripe_lock[i].lock);
     }
-    spinlock_release(&page_table->table_lock);
+    spinlock_cleanup(&page_table->table_lock.lock);
+    kfree(page_table->hash_anchor);
     kfree(page_table);
+    page_table = NULL;
+}
+
+// called by vm_fault() once the page has been written in the TLB. Nothing is done if it has been evicted meanwhile
+void page_table_set_tlb_index(pid_t pid, vaddr_t vaddr, int tlb_index){
+    pt_lock_t *stripe = page_table_stripe(pid, vaddr);
+    int i;
+
+    page_table_lock(stripe);
+    i = page_table_lookup(pid, vaddr);
+    if (i != PT_NO_ENTRY)
+        page_table->frames[i].tlb_index = tlb_index;
+    page_table_unlock(stripe);
+}
+
+/*
+ * Called by vm_fault() every time the page is loaded in the TLB. Returns 0 if the page must
+ * not be mapped, as it has been evicted or is being written out since it was looked up
+ */
+int page_table_mark_referenced(pid_t pid, vaddr_t vaddr, int write){
+    pt_lock_t *stripe = page_table_stripe(pid, vaddr);
+    int i, prefetched = 0, slot = PT_NO_SLOT;
+
+    page_table_lock(stripe);
+    i = page_table_lookup(pid, vaddr);
+    if (i != PT_NO_ENTRY && page_table_busy(i))
+        i = PT_NO_ENTRY;
+    if (i != PT_NO_ENTRY) {
+        prefetched = IS_PREFETCHED(page_table->frames[i].status);
+        page_table->frames[i].status = CLEAR_PREFETCHED(SET_REFERENCED(page_table->frames[i].status));
+        if (write) {
+            // the copy in the swap area is out of date from now on
+            if (IS_SWAPCACHED(page_table->frames[i].status)) {
+                slot = page_table->coremap[i].links.swap_slot;
+                page_table->coremap[i].links.swap_slot = PT_NO_SLOT;
+            }
+            page_table->frames[i].status = CLEAR_SWAPCACHED(SET_DIRTY(page_table->frames[i].status));
+        }
+    }
+    page_table_unlock(stripe);
+
+    if (prefetched)
+        swap_readahead_feedback(1);
+    if (slot != PT_NO_SLOT)
+        swap_cache_drop(pid, vaddr, slot);
+    return i != PT_NO_ENTRY;
+}
+
+// sleep while the page (pid, vaddr) is being written out: it is then either gone or released
+void page_table_wait_pageout(pid_t pid, vaddr_t vaddr){
+    pt_lock_t *stripe = page_table_stripe(pid, vaddr);
+    int i;
+
+    page_table_lock(stripe);
+    while ((i = page_table_lookup(pid, vaddr)) != PT_NO_ENTRY && page_table_busy(i)){
+        // the time asleep is not a hold: close it before sleeping, restart it when the lock is taken back
+        page_table_lock_held(stripe);
+        wchan_sleep(page_table->pageout_wchan[stripe - page_table->stripe_lock], &stripe->lock);
+        stripe->since = cpu_cycles();
+    }
+    page_table_unlock(stripe);
 }
 
-unsigned char page_table_get_Status_on_Index(int index){
-    return page_table->next_entry[index].status;
+/*
+ * Called on every hardclock, on one cpu, if the current policy ages the frames: see
+ * page_table_age_frames().
+ */
+void page_table_age_tick(void){
+    struct pt_policy *policy;
+
+    if (page_table == NULL)
+        return;
+
+    // read without the lock: a tick of the policy just replaced does no harm
+    policy = page_table->policy;
+    if (policy != NULL && policy->tick != NULL)
+        policy->tick();
 }
 
-void page_table_set_status_at_index(int index, unsigned char val){
-    page_table->next_entry[index].status |= val;
-}
\ No newline at end of file
+int page_table_set_policy(const char *name){
+    unsigned int i;
+
+    for(i=0; i<PT_NPOLICIES; i++){
+        if (strcmp(name, policies[i].name) == 0) {
+            page_table_lock(&page_table->table_lock);
+            page_table->policy = &policies[i];
+            page_table_unlock(&page_table->table_lock);
+            return 0;
+        }
+    }
+    return EINVAL;
+}
+
+int page_table_set_scope(const char *scope){
+    int global_scope;
+
+    if (strcmp(scope, "local") == 0)
+        global_scope = 0;
+    else if (strcmp(scope, "global") == 0)
+        global_scope = 1;
+    else
+        return EINVAL;
+
+    page_table_lock(&page_table->table_lock);
+    page_table->global_scope = global_scope;
+    page_table_unlock(&page_table->table_lock);
+    return 0;
+}
+
+const char *page_table_get_policy_name(void){
+    return page_table->policy->name;
+}
+
+const char *page_table_get_scope_name(void){
+    return page_table->global_scope ? "global" : "local";
+}
+
+// decision cost of every policy that has been used
+void page_table_print_policy_stats(void){
+    unsigned int i;
+
+    for(i=0; i<PT_NPOLICIES; i++){
+        if (policies[i].decisions == 0 && &policies[i] != page_table->policy)
+            continue;
+        kprintf("%s: decisions=%u, frames_examined=%u, frames_examined_per_decision=%u\n",
+            policies[i].name, policies[i].decisions, policies[i].examined,
+            policies[i].decisions == 0 ? 0 : policies[i].examined / policies[i].decisions);
+    }
+}
+
+// contention of the page table locks and how long they are held, in cycles, to compare runs with different numbers of CPUs
+void page_table_print_lock_stats(void){
+    unsigned int i, contended = 0, spins = 0;
+    uint32_t max_held = 0;
+    uint64_t held = 0;
+    pt_lock_t *l = &page_table->table_lock;
+
+    for(i=0; i<PT_LOCK_STRIPES; i++){
+        contended += page_table->stripe_lock[i].contended;
+        spins += page_table->stripe_lock[i].spins;
+        held += page_table->stripe_lock[i].held;
+        if (page_table->stripe_lock[i].max_held > max_held)
+            max_held = page_table->stripe_lock[i].max_held;
+    }
+    kprintf("table_lock: contended=%u, spins=%u, spins_per_contended=%u, held_cycles=%llu, max_held_cycles=%u\n",
+        l->contended, l->spins, l->contended == 0 ? 0 : l->spins / l->contended,
+        (unsigned long long)l->held, l->max_held);
+    kprintf("stripe_locks (%d): contended=%u, spins=%u, spins_per_contended=%u, held_cycles=%llu, max_held_cycles=%u\n",
+        PT_LOCK_STRIPES, contended, spins, contended == 0 ? 0 : spins / contended,
+        (unsigned long long)held, max_held);
+}
+
+/*
+ * Pages that can be swapped out together with the page at vaddr of process pid: the resident
+ * pages following it in the address space, at most max. The run stops at the first page that
+ * is not resident or already being swapped out or, if cold is set, that has been referenced in
+ * the last 8 aging ticks. The pages returned are marked PAGEOUT, like the victim.
+ * Returns their number, with copies of their entries and their frame indexes.
+ */
+int page_table_cluster(pid_t pid, vaddr_t vaddr, int max, int cold, entry_t *entries, int *indexes){
+    pt_lock_t *stripe;
+    int n, i;
+
+    KASSERT(pid >= 0 && pid <= MAX_PROC);
+
+    page_table_lock(&page_table->table_lock);
+    for(n=0; n<max; n++){
+        vaddr += PAGE_SIZE;
+        if (vaddr >= MIPS_KSEG0)
+            break;
+        stripe = page_table_stripe(pid, vaddr);
+        page_table_lock(stripe);
+        i = page_table_lookup(pid, vaddr);
+        if (i != PT_NO_ENTRY && page_table_busy(i))
+            i = PT_NO_ENTRY;
+        if (i != PT_NO_ENTRY && cold &&
+            (IS_REFERENCED(page_table->frames[i].status) || page_table->frames[i].age != 0))
+            i = PT_NO_ENTRY;
+        if (i != PT_NO_ENTRY) {
+            page_table_mark_pageout(i);
+            page_table_get_entry(i, &entries[n]);
+            indexes[n] = i;
+        }
+        page_table_unlock(stripe);
+        if (i == PT_NO_ENTRY)
+            break;
+    }
+    page_table_unlock(&page_table->table_lock);
+
+    return n;
+}
+
+// oldest resident page of the process not being swapped out, marked PAGEOUT; -1 if there is none
+int page_table_first_resident(pid_t pid, entry_t *entry){
+    int i;
+
+    KASSERT(pid >= 0 && pid <= MAX_PROC);
+
+    page_table_lock(&page_table->table_lock);
+    i = page_table->fifo[pid].head;
+    while (i != PT_NO_ENTRY && page_table_busy(i))
+        i = page_table->coremap[i].links.fifo_next;
+    if (i != PT_NO_ENTRY) {
+        page_table_set_pageout(i);
+        page_table_get_entry(i, entry);
+    }
+    page_table_unlock(&page_table->table_lock);
+
+    return i;
+}
+
+// the pages chosen for eviction stay in RAM (the swap area is full): they are candidates again
+void page_table_release(int n, const int *indexes){
+    pt_lock_t *stripe;
+    int k;
+
+    page_table_lock(&page_table->table_lock);
+    for(k=0; k<n; k++){
+        stripe = page_table_frame_stripe(indexes[k]);
+        page_table_lock(stripe);
+        page_table->frames[indexes[k]].status = CLEAR_PAGEOUT(page_table->frames[indexes[k]].status);
+        page_table_wake_pageout(stripe);
+        page_table_unlock(stripe);
+    }
+    page_table_unlock(&page_table->table_lock);
+}
+
+unsigned int page_table_get_resident(pid_t pid){
+    KASSERT(pid >= 0 && pid <= MAX_PROC);
+    return page_table->fifo[pid].count;
+}
+
+unsigned int page_table_get_length(void){
+    return page_table->length;
+}
@@ -15,172 +15,922 @@
 #include <coremap.h>
 #include "pt.h"
 #include <vm_stats.h>
+#include <synch.h>
+#include <kern/errno.h>
+#include <clock.h>
+#include <zswap.h>
+#include <vm_tlb.h>
 
-#define FILESIZE 9437184 // 9 * 1024 * 1024 (9 MB)
+#define FILESIZE 9437184 // 9 * 1024 * 1024 (9 MB), default size of the swap area
 #define NUMBERENTRIES FILESIZE/PAGE_SIZE // (9 * 1024 * 1024) / PAGE_SIZE = 2304
 #define FILENAME "emu0:SWAPFILE" //emu0 is the default secondary memory
 
+#define SWAPBUCKETS 1024 // power of 2
+#define SWAP_MAP_WORDS(n) (((n) + 31) / 32)
+#define SWAP_NONE -1
+#define SWAP_GROW_PAGES 256 // the swapfile is extended 1 MB at a time
+#define SWAP_MAX_DEVICES 4
+#define SWAP_RA_MAX (SWAP_CLUSTER - 1) // pages read ahead at most
+#define SWAP_RA_PERIOD 32 // pages read ahead judged between two resizes of the window
+
+#define SLOT_INVALID 0
+#define SLOT_VALID 1 // the page is only in the swap area
+#define SLOT_CACHED 2 // the page is resident too, and has not been written since it was swapped in
+#define SLOT_ZERO 3 // the page was all zero: nothing has been written, the slot is not backed
+
+// where swap_out() puts a page
+#define OUT_DISCARD -1 // nowhere: clean, read again from the ELF file at the next fault
+#define OUT_CACHED 0 // nowhere: clean, with an up to date copy in its cached slot
+#define OUT_ZERO 1 // in a SLOT_ZERO slot
+#define OUT_COMPRESSED 2 // in the compressed pool
+#define OUT_WRITE 3 // in a slot of the run written to the backends
+
 typedef struct swap_track {
     permission_t permission_flag;
     pid_t pid;
     vaddr_t vaddr;
-    unsigned char valid; //0 invalid, 1 valid
+    unsigned char valid; // SLOT_INVALID, SLOT_VALID, SLOT_CACHED or SLOT_ZERO
+    int next; // next slot in the same bucket of the index
 } swap_track;
 
-swap_track track[NUMBERENTRIES]; //track as static array since we already know the size of swapfile and page size. No need to allocate it as dynamic
-
-struct vnode *swap_vnode;
+/*
+ * The swap area has swap_pages slots, NUMBERENTRIES unless set by swap_set_size(). It can
+ * only grow: track and swap_map are then reallocated, while the swapfiles are extended on
+ * demand, SWAP_GROW_PAGES at a time, when a slot past their end is allocated.
+ */
+static swap_track *track;
+static unsigned int swap_pages; // slots of the swap area
+static struct lock *swap_grow_lock; // serializes the extensions of the swapfiles
+
+/*
+ * Slots are allocated from a bitmap, one bit per slot, set while the slot is in use (also
+ * while it is being written). Allocation is next fit: it starts from the word of the last
+ * allocated slot, so it finds a free slot after looking at few words. The valid slots are
+ * found by (pid, vaddr) through a hash index with chains of slot indexes, the slot number
+ * giving the offset in the swapfile.
+ */
+static uint32_t *swap_map;
+static unsigned int swap_hint = 0; // word where the next allocation starts
+static int swap_index[SWAPBUCKETS];
+
+/*
+ * Ghost list of the 2Q replacement (A1out): (pid, vaddr) of the pages recently evicted from A1in.
+ * It is bounded: the slots are reused in circular order, so the oldest ghost is forgotten first.
+ * Lookups go through a small hash with chains of slot indexes.
+ */
+#define GHOSTENTRIES 1024
+#define GHOSTBUCKETS 256 // power of 2
+#define GHOST_NONE -1
+
+typedef struct swap_ghost {
+    pid_t pid; // -1 if the slot is free
+    vaddr_t vaddr;
+    int next; // next slot in the same bucket
+} swap_ghost;
+
+static swap_ghost ghost[GHOSTENTRIES];
+static int ghost_hash[GHOSTBUCKETS];
+static int ghost_next_slot = 0; // slot taken by the next ghost
+
+/*
+ * Backends of the swap area: files, extended on demand, or raw disk devices such as
+ * lhd1raw:, whose page-sized I/O goes straight to the disk driver without file system.
+ * The slots are striped over them: slot i is page i / swap_ndevs of backend
+ * i % swap_ndevs. The next fit allocation hands out consecutive slots, so consecutive
+ * page outs go to different backends and the I/O of concurrent faults overlaps.
+ * The backends can be changed by swap_set_devices() while no slot is in use.
+ */
+typedef struct swap_dev {
+    char *name;
+    struct vnode *vnode;
+    int raw; // 1 if it is a raw device, which cannot grow
+    unsigned int pages; // pages backed by the device
+    unsigned int queued; // transfers in progress on the device
+    unsigned int max_queued; // highest number of transfers in progress
+    unsigned int reads, writes; // pages transferred
+    unsigned int read_ios, write_ios; // transfers done, each of one or more pages
+    uint64_t read_ns, write_ns; // time spent in them
+} swap_dev;
+
+static swap_dev swap_devs[SWAP_MAX_DEVICES];
+static unsigned int swap_ndevs;
+static unsigned int swap_used; // slots in use
+static unsigned int swap_cached; // slots in use that are a copy of a resident page
 static struct spinlock slock = SPINLOCK_INITIALIZER; //Init spinlock like this in every other file
+static struct spinlock ghost_lock = SPINLOCK_INITIALIZER;
+
+/*
+ * Readahead: a swap in also reads the following slots, as long as they hold the following
+ * pages of the same process, as written by a clustered swap out. Up to swap_ra_window pages
+ * are read ahead. Every SWAP_RA_PERIOD of them used or evicted, the window doubles if at
+ * least 3/4 were used and halves if less than 1/4 were.
+ */
+static unsigned int swap_ra_window = 2;
+static unsigned int swap_ra_hits = 0, swap_ra_judged = 0;
+static struct spinlock ra_lock = SPINLOCK_INITIALIZER;
+
+/*
+ * Swap cache: a swap in does not free the slots it reads. They stay in the index as
+ * SLOT_CACHED, linked from the frames, until the page is written (see
+ * page_table_mark_referenced()). A clean page evicted with a cached slot needs no write:
+ * the slot just becomes SLOT_VALID again.
+ */
+
+// hash of (pid, vaddr) in a table of nbuckets buckets, nbuckets power of 2
+static int swap_hash(pid_t pid, vaddr_t vaddr, int nbuckets) {
+    return ((vaddr / PAGE_SIZE) ^ ((uint32_t)pid * 0x9e3779b1)) & (nbuckets - 1);
+}
 
-void swap_bootstrap(void) {
-    int i;
-    int err;
-    struct stat info_file; //used to get information in the file (size, ...)
-    char path[sizeof(FILENAME)];
+static int ghost_bucket(pid_t pid, vaddr_t vaddr) {
+    return swap_hash(pid, vaddr, GHOSTBUCKETS);
+}
 
-    //parameters to create swapfile if it does not exist
-    struct iovec iov;
-    struct uio myuio;
-    int kb = 1024;
-    int kb_in_FILESIZE = FILESIZE/kb;
-    char buf[kb_in_FILESIZE];
+// take a free slot, SWAP_NONE if the swapfile is full. Swap lock must be held
+static int swap_slot_alloc(void) {
+    unsigned int n, w;
+    int b;
+
+    for(n=0; n<SWAP_MAP_WORDS(swap_pages); n++) {
+        w = (swap_hint + n) % SWAP_MAP_WORDS(swap_pages);
+        if (swap_map[w] != 0xffffffff) {
+            for(b=0; swap_map[w] & (1u << b); b++);
+            swap_map[w] |= 1u << b;
+            swap_hint = w;
+            swap_used++;
+            return w * 32 + b;
+        }
+    }
+    return SWAP_NONE;
+}
 
-	strcpy(path, FILENAME);
+// first of n consecutive free slots in [from, to), SWAP_NONE if there is none. Swap lock must be held
+static int swap_run_find(unsigned int from, unsigned int to, unsigned int n) {
+    unsigned int i, run = 0;
 
-    if((err = vfs_open(path, O_CREAT | O_RDWR, 0, &swap_vnode))) { //open file 
-        panic("[ERR] swapfile.c: error %d opening swapfile %s\n", err, FILENAME);
+    for(i=from; i<to; i++) {
+        if (i % 32 == 0 && i + 32 <= to && swap_map[i / 32] == 0xffffffff) {
+            run = 0;
+            i += 31; // the whole word is taken
+            continue;
+        }
+        if (swap_map[i / 32] & (1u << (i % 32)))
+            run = 0;
+        else if (++run == n)
+            return i - n + 1;
     }
+    return SWAP_NONE;
+}
+
+// take n consecutive free slots, next fit. Returns the first one, SWAP_NONE if there is no such run. Swap lock must be held
+static int swap_run_alloc(unsigned int n) {
+    unsigned int i, from = swap_hint * 32;
+    int first;
+
+    if (n == 1)
+        return swap_slot_alloc();
+
+    if (from >= swap_pages)
+        from = 0;
+    first = swap_run_find(from, swap_pages, n);
+    if (first == SWAP_NONE)
+        first = swap_run_find(0, from, n);
+    if (first == SWAP_NONE)
+        return SWAP_NONE;
+
+    for(i=first; i<first+n; i++)
+        swap_map[i / 32] |= 1u << (i % 32);
+    swap_hint = (first + n - 1) / 32;
+    swap_used += n;
+    return first;
+}
+
+// give slot i back. Swap lock must be held
+static void swap_slot_free(int i) {
+    swap_map[i / 32] &= ~(1u << (i % 32));
+    swap_used--;
+}
 
-    VOP_STAT(swap_vnode, &info_file); //get information of the file and store it into the stat variable
-    if(info_file.st_size < FILESIZE) {
+// make slot i valid and reachable from its (pid, vaddr). Swap lock must be held
+static void swap_index_insert(int i) {
+    int bucket = swap_hash(track[i].pid, track[i].vaddr, SWAPBUCKETS);
 
-        for(i=0; i<kb_in_FILESIZE + 1; i++) {
-            uio_kinit(&iov, &myuio, (void *)buf, 1, kb*i, UIO_WRITE);
-            if ((err = VOP_WRITE(swap_vnode, &myuio))) 
-                panic("[ERR] swapfile.c: write error %d\n",err);
+    track[i].valid = SLOT_VALID;
+    track[i].next = swap_index[bucket];
+    swap_index[bucket] = i;
+}
+
+// unlink slot i from the index and free it. Swap lock must be held
+static void swap_index_remove(int i) {
+    int *link = &swap_index[swap_hash(track[i].pid, track[i].vaddr, SWAPBUCKETS)];
+
+    while (*link != SWAP_NONE) {
+        if (*link == i) {
+            *link = track[i].next;
+            break;
         }
+        link = &track[*link].next;
+    }
+    if (track[i].valid == SLOT_CACHED)
+        swap_cached--;
+    track[i].pid = -1;
+    track[i].valid = SLOT_INVALID;
+    track[i].next = SWAP_NONE;
+    swap_slot_free(i);
+}
 
-        VOP_STAT(swap_vnode, &info_file); //get information of the file and store it into the stat variable
-        if(info_file.st_size < FILESIZE) {
-            panic("[ERR] swapfile.c: swapfile size %lu, it must be at least %lu. Increase size!\n", (unsigned long) info_file.st_size, (unsigned long) FILESIZE);
+// slot holding (pid, vaddr) while it is not resident, SWAP_NONE if it is not in the swapfile. Swap lock must be held
+static int swap_index_lookup(pid_t pid, vaddr_t vaddr) {
+    int i;
+
+    for (i = swap_index[swap_hash(pid, vaddr, SWAPBUCKETS)]; i != SWAP_NONE; i = track[i].next) {
+        if (track[i].pid == pid && track[i].vaddr == vaddr && (track[i].valid == SLOT_VALID || track[i].valid == SLOT_ZERO))
+            break;
+    }
+    return i;
+}
+
+// unlink slot i from its chain. Ghost lock must be held
+static void ghost_unlink(int i) {
+    int *link = &ghost_hash[ghost_bucket(ghost[i].pid, ghost[i].vaddr)];
+
+    while (*link != GHOST_NONE) {
+        if (*link == i) {
+            *link = ghost[i].next;
+            break;
         }
+        link = &ghost[*link].next;
+    }
+    ghost[i].pid = -1;
+    ghost[i].next = GHOST_NONE;
+}
+
+// mark the slots from first on as free up to swap_pages, as taken after it. Swap lock must be held
+static void swap_map_init(unsigned int first) {
+    unsigned int i;
+
+    for(i=first; i<SWAP_MAP_WORDS(swap_pages)*32; i++) {
+        if (i < swap_pages)
+            swap_map[i / 32] &= ~(1u << (i % 32));
+        else
+            swap_map[i / 32] |= 1u << (i % 32); // bits past the last slot are never free
     }
+}
 
-    for(i=0; i<NUMBERENTRIES; i++) {
+// extend the backend of slot i so that it backs it. Returns 0 or the error of the file system
+static int swap_grow(unsigned int i) {
+    swap_dev *d = &swap_devs[i % swap_ndevs];
+    unsigned int page = i / swap_ndevs, pages;
+    int err = 0;
+
+    lock_acquire(swap_grow_lock);
+    if (page >= d->pages && d->raw)
+        err = ENOSPC; // past the end of the partition
+    else if (page >= d->pages) {
+        pages = (page / SWAP_GROW_PAGES + 1) * SWAP_GROW_PAGES;
+        err = VOP_TRUNCATE(d->vnode, (off_t)pages * PAGE_SIZE);
+        if (!err)
+            d->pages = pages;
+    }
+    lock_release(swap_grow_lock);
+
+    return err;
+}
+
+/*
+ * Open the backend name, creating it if it is a file that does not exist. pages is set to
+ * the number of slots it already backs, raw to 1 if it is a block device.
+ */
+static int swap_open(const char *name, swap_dev *d) {
+    struct stat info_file; //used to get information in the file (size, ...)
+    char *path;
+    int err;
+
+    path = kstrdup(name); // vfs_open() modifies the path
+    if (path == NULL)
+        return ENOMEM;
+    err = vfs_open(path, O_RDWR, 0, &d->vnode);
+    if (err == ENOENT) {
+        strcpy(path, name);
+        err = vfs_open(path, O_CREAT | O_RDWR, 0, &d->vnode);
+    }
+    if (err) {
+        kfree(path);
+        return err;
+    }
+
+    if ((err = VOP_STAT(d->vnode, &info_file))) { //get information of the file and store it into the stat variable
+        vfs_close(d->vnode);
+        kfree(path);
+        return err;
+    }
+    strcpy(path, name);
+    d->name = path;
+    d->raw = (info_file.st_mode & _S_IFMT) == S_IFBLK;
+    d->pages = info_file.st_size / PAGE_SIZE;
+    d->queued = d->max_queued = 0;
+    d->reads = d->writes = 0;
+    d->read_ios = d->write_ios = 0;
+    d->read_ns = d->write_ns = 0;
+    return 0;
+}
+
+static void swap_close(swap_dev *d) {
+    vfs_close(d->vnode);
+    kfree(d->name);
+}
+
+/*
+ * Read or write the pages at paddrs[0..n-1] from or to the n slots from first on. The slots of
+ * each backend are consecutive pages of it, so every backend does a single transfer, with one
+ * iovec per page.
+ */
+static void swap_run_io(int first, int n, const paddr_t *paddrs, enum uio_rw rw) {
+    struct iovec iov[SWAP_CLUSTER];
+    struct uio myuio;
+    struct timespec start, end, diff;
+    swap_dev *d;
+    uint64_t ns;
+    unsigned int dev;
+    int k, m, err;
+
+    KASSERT(n >= 1 && n <= SWAP_CLUSTER);
+
+    for(dev=0; dev<swap_ndevs; dev++) {
+        // the slots first + k of this backend: k = k0, k0 + swap_ndevs, ...
+        k = (swap_ndevs - first % swap_ndevs + dev) % swap_ndevs;
+        if (k >= n)
+            continue;
+        d = &swap_devs[(first + k) % swap_ndevs];
+
+        myuio.uio_offset = (off_t)((first + k) / swap_ndevs) * PAGE_SIZE;
+        for(m=0; k<n; k+=swap_ndevs, m++) {
+            iov[m].iov_kbase = (void *)PADDR_TO_KVADDR(paddrs[k]);
+            iov[m].iov_len = PAGE_SIZE;
+        }
+        myuio.uio_iov = iov;
+        myuio.uio_iovcnt = m;
+        myuio.uio_resid = m * PAGE_SIZE;
+        myuio.uio_segflg = UIO_SYSSPACE;
+        myuio.uio_rw = rw;
+        myuio.uio_space = NULL;
+
+        spinlock_acquire(&slock);
+        d->queued++;
+        if (d->queued > d->max_queued)
+            d->max_queued = d->queued;
+        spinlock_release(&slock);
+
+        gettime(&start);
+        if (rw == UIO_READ)
+            err = VOP_READ(d->vnode, &myuio);
+        else
+            err = VOP_WRITE(d->vnode, &myuio);
+        gettime(&end);
+        if (err)
+            panic("[ERR] swapfile.c: %s error %d\n", rw == UIO_READ ? "read" : "write", err);
+
+        if (myuio.uio_resid!=0) // uio_resid is the amount of data left to transfer. If there is more, then error
+            panic("[ERR] swapfile.c: uio_resid != 0\n");
+
+        timespec_sub(&end, &start, &diff);
+        ns = (uint64_t)diff.tv_sec * 1000000000 + diff.tv_nsec;
+        spinlock_acquire(&slock);
+        d->queued--;
+        if (rw == UIO_READ) {
+            d->reads += m;
+            d->read_ios++;
+            d->read_ns += ns;
+        }
+        else {
+            d->writes += m;
+            d->write_ios++;
+            d->write_ns += ns;
+        }
+        spinlock_release(&slock);
+    }
+}
+
+void swap_bootstrap(void) {
+    int i;
+    int err;
+
+    /*
+     * Nothing is written here: the slots already in the file are used as they are, and
+     * the file is extended by swap_grow() when a slot past its end is first written.
+     * So the boot does not depend on the size of the swap area.
+     */
+    if((err = swap_open(FILENAME, &swap_devs[0])))
+        panic("[ERR] swapfile.c: error %d opening swapfile %s\n", err, FILENAME);
+    swap_ndevs = 1;
+
+    swap_pages = NUMBERENTRIES;
+    track = kmalloc(swap_pages * sizeof(swap_track));
+    swap_map = kmalloc(SWAP_MAP_WORDS(swap_pages) * sizeof(uint32_t));
+    swap_grow_lock = lock_create("swap_grow_lock");
+    if (track == NULL || swap_map == NULL || swap_grow_lock == NULL)
+        panic("[ERR] swapfile.c: error to allocate the swap area\n");
+
+    for(i=0; i<(int)swap_pages; i++) {
         track[i].permission_flag = 0;
         track[i].pid = -1;
         track[i].vaddr = 0;
-        track[i].valid = 0;
+        track[i].valid = SLOT_INVALID;
+        track[i].next = SWAP_NONE;
+    }
+    for(i=0; i<SWAPBUCKETS; i++)
+        swap_index[i] = SWAP_NONE;
+    swap_map_init(0);
+
+    for(i=0; i<GHOSTENTRIES; i++) {
+        ghost[i].pid = -1;
+        ghost[i].vaddr = 0;
+        ghost[i].next = GHOST_NONE;
     }
+    for(i=0; i<GHOSTBUCKETS; i++)
+        ghost_hash[i] = GHOST_NONE;
 }
 
-void swap_out(pid_t pid, vaddr_t vaddr, permission_t permission_flag, paddr_t paddr) { //load frame from ram into swapfile
-    int i;
-    int err;
-    struct iovec iov;
-    struct uio myuio;
+// 1 if the frame holds only zeros
+static int swap_page_is_zero(paddr_t paddr) {
+    const uint32_t *words = (const uint32_t *)PADDR_TO_KVADDR(paddr);
+    unsigned int k;
+
+    for(k=0; k<PAGE_SIZE/sizeof(uint32_t); k++) {
+        if (words[k] != 0)
+            return 0;
+    }
+    return 1;
+}
 
-    if (vaddr>=MIPS_KSEG0) // check I am in MIPS_KUSEG area
-        panic("[ERR] swapfile.c: vaddr cannot be greater than MIPS_KSEG0\n");
+// give back what swap_out() took for the pages before failing
+static void swap_out_undo(int n, const entry_t *pages, const int *how, const int *zero_slots) {
+    int k;
 
     spinlock_acquire(&slock);
-    for(i=0; i<NUMBERENTRIES; i++) {
-        if(track[i].valid == 0)
-            break;
+    for(k=0; k<n; k++) {
+        if (how[k] == OUT_ZERO && zero_slots[k] != SWAP_NONE)
+            swap_slot_free(zero_slots[k]);
     }
+    spinlock_release(&slock);
 
-    if(i == NUMBERENTRIES)
-        panic("[ERR] swapfile.c: out of swap space\n");
+    for(k=0; k<n; k++) {
+        if (how[k] == OUT_COMPRESSED)
+            zswap_remove(pages[k].pid, pages[k].vaddr);
+    }
+}
 
-    uio_kinit(&iov, &myuio, (void *)PADDR_TO_KVADDR(paddr), PAGE_SIZE, i*PAGE_SIZE, UIO_WRITE);
-    if ((err = VOP_WRITE(swap_vnode, &myuio))) 
-        panic("[ERR] swapfile.c: write error %d\n",err);
+// the slot no longer holds a copy of the page (pid, vaddr): take it out of the index
+static void swap_slot_forget(pid_t pid, vaddr_t vaddr, int slot) {
+    spinlock_acquire(&slock);
+    if (track[slot].valid != SLOT_INVALID && track[slot].pid == pid && track[slot].vaddr == vaddr)
+        swap_index_remove(slot);
+    spinlock_release(&slock);
+}
+
+int swap_out(int n, const entry_t *pages, paddr_t *paddrs) { //load frames from ram into swapfile
+    int first = SWAP_NONE, k, m, slot;
+    int err = 0;
+    int how[SWAP_CLUSTER]; // where page k goes, OUT_*
+    int zero_slots[SWAP_CLUSTER]; // slot of page k if it is all zero
+    paddr_t write_paddrs[SWAP_CLUSTER];
+
+    KASSERT(n <= SWAP_CLUSTER);
+
+    for(k=0; k<n; k++) {
+        if (pages[k].vaddr>=MIPS_KSEG0) // check I am in MIPS_KUSEG area
+            panic("[ERR] swapfile.c: vaddr cannot be greater than MIPS_KSEG0\n");
+    }
+
+    // the pages were unmapped when they were chosen: no other cpu may write them while they are read
+    tlb_shootdown_wait();
+
+    spinlock_acquire(&slock);
+    for(k=0; k<n; k++) {
+        if (IS_ELF(pages[k].status) && !IS_DIRTY(pages[k].status))
+            how[k] = OUT_DISCARD;
+        else if (pages[k].swap_slot != PT_NO_SLOT && IS_SWAPCACHED(pages[k].status) &&
+            !IS_DIRTY(pages[k].status) && track[pages[k].swap_slot].valid == SLOT_CACHED &&
+            track[pages[k].swap_slot].pid == pages[k].pid && track[pages[k].swap_slot].vaddr == pages[k].vaddr)
+            how[k] = OUT_CACHED;
+        else
+            how[k] = OUT_WRITE;
+        zero_slots[k] = SWAP_NONE;
+    }
+    spinlock_release(&slock);
+
+    // the pages all zero only need a slot, the others go to the compressed pool if they can,
+    // the rest is written in a run of slots
+    for(k=0, m=0; k<n; k++) {
+        if (how[k] != OUT_WRITE)
+            continue;
+        if (swap_page_is_zero(paddrs[k]))
+            how[k] = OUT_ZERO;
+        else if (zswap_store(&pages[k], paddrs[k]) == 0)
+            how[k] = OUT_COMPRESSED;
+        else
+            write_paddrs[m++] = paddrs[k];
+    }
+
+    spinlock_acquire(&slock);
+    for(k=0; k<n && !err; k++) {
+        if (how[k] == OUT_ZERO && (zero_slots[k] = swap_slot_alloc()) == SWAP_NONE)
+            err = ENOSPC;
+    }
+    if (!err && m > 0 && (first = swap_run_alloc(m)) == SWAP_NONE)
+        err = ENOSPC;
+    spinlock_release(&slock);
+
+    if (err) {
+        swap_out_undo(n, pages, how, zero_slots);
+        return err; // out of swap space: the pages stay in RAM
+    }
+
+    for(k=0; k<m; k++) {
+        if((first + k) / swap_ndevs >= swap_devs[(first + k) % swap_ndevs].pages && (err = swap_grow(first + k))) {
+            spinlock_acquire(&slock);
+            for(k=0; k<m; k++)
+                swap_slot_free(first + k);
+            spinlock_release(&slock);
+            swap_out_undo(n, pages, how, zero_slots);
+            return err;
+        }
+    }
+
+    // the slots are taken but not valid yet: nobody else uses them while they are written
+    if (m > 0)
+        swap_run_io(first, m, write_paddrs, UIO_WRITE);
 
     //Set the entries
-    track[i].valid = 1;
-    track[i].pid = pid;
-    track[i].permission_flag = permission_flag;
-    track[i].vaddr = vaddr;
-    
+    spinlock_acquire(&slock);
+    for(k=0, m=0; k<n; k++) {
+        if (how[k] == OUT_DISCARD)
+            continue;
+        if (how[k] == OUT_CACHED) {
+            // still cached unless the page has been written meanwhile
+            if (track[pages[k].swap_slot].valid == SLOT_CACHED) {
+                track[pages[k].swap_slot].valid = SLOT_VALID;
+                swap_cached--;
+            }
+            continue;
+        }
+        if (pages[k].swap_slot != PT_NO_SLOT && track[pages[k].swap_slot].valid == SLOT_CACHED &&
+            track[pages[k].swap_slot].pid == pages[k].pid && track[pages[k].swap_slot].vaddr == pages[k].vaddr)
+            swap_index_remove(pages[k].swap_slot); // out of date copy
+        if (how[k] == OUT_COMPRESSED)
+            continue;
+        slot = how[k] == OUT_ZERO ? zero_slots[k] : first + m++;
+        track[slot].pid = pages[k].pid;
+        track[slot].permission_flag = pages[k].permission_flag;
+        track[slot].vaddr = pages[k].vaddr;
+        swap_index_insert(slot);
+        if (how[k] == OUT_ZERO)
+            track[slot].valid = SLOT_ZERO;
+    }
     spinlock_release(&slock);
 
-    page_table_reset_entry(paddr/PAGE_SIZE); //invalid pagetable entry
+    for(k=0; k<n; k++) {
+        if (how[k] == OUT_CACHED || how[k] == OUT_DISCARD) {
+            // it was mapped clean: if it has been written meanwhile, its copy (in the slot or in the
+            // ELF file) is out of date and it stays
+            if (!page_table_reset_clean_entry(paddrs[k]/PAGE_SIZE)) {
+                if (how[k] == OUT_CACHED)
+                    swap_slot_forget(pages[k].pid, pages[k].vaddr, pages[k].swap_slot);
+                paddrs[k] = 0;
+                continue;
+            }
+        }
+        else
+            page_table_reset_entry(paddrs[k]/PAGE_SIZE); //invalid pagetable entry
+        increment_page_faults_swapout();
+        if (how[k] == OUT_DISCARD)
+            increment_swap_elf_discards();
+        else if (how[k] == OUT_CACHED)
+            increment_swap_writes_avoided();
+        else if (how[k] == OUT_ZERO)
+            increment_swap_zero_pages();
+    }
+    return 0;
+}
 
-    increment_page_faults_swapout();
+// swap_in() of a page of the compressed pool: no readahead, and no slot to keep
+static int swap_in_compressed(struct addrspace *as, pid_t pid, vaddr_t vaddr, paddr_t *paddr) {
+    permission_t permission_flag;
+
+    if (!zswap_contains(pid, vaddr))
+        return 0;
+
+    *paddr = vm_get_user_frame(as, pid);
+    if(*paddr == 0)
+        return -1;
+
+    if (zswap_load(pid, vaddr, *paddr, &permission_flag)) {
+        freeppages(*paddr);
+        return 0;
+    }
+
+    page_table_add_entry(pid, vaddr, *paddr, permission_flag == READ_ONLY ? SET_READONLY(0) : 0, PT_NO_SLOT);
+    increment_page_faults_swapin();
+    return 1;
 }
 
 int swap_in(struct addrspace *as, pid_t pid, vaddr_t vaddr, paddr_t *paddr) { //load from swapfile to ram
-    int i;
-    int err;
-    int index_page_to_replace;
-    struct iovec iov;
-    struct uio myuio;
-    entry_t empty_entry;
+    int i, k, n, ahead, zero;
+    uint32_t status[SWAP_CLUSTER];
+    paddr_t paddrs[SWAP_CLUSTER];
+
+    spinlock_acquire(&ra_lock);
+    ahead = swap_ra_window;
+    spinlock_release(&ra_lock);
 
     spinlock_acquire(&slock);
-    for(i=0; i<NUMBERENTRIES; i++) {
-        if(track[i].pid == pid && track[i].vaddr == vaddr && track[i].valid == 1) {
+    i = swap_index_lookup(pid, vaddr);
+    zero = i != SWAP_NONE && track[i].valid == SLOT_ZERO;
+    // the following slots holding the following pages of the process
+    for(n=1; i != SWAP_NONE && !zero && n<=ahead && i+n<(int)swap_pages; n++) {
+        if (track[i+n].valid != SLOT_VALID || track[i+n].pid != pid || track[i+n].vaddr != vaddr + n*PAGE_SIZE)
+            break;
+    }
+    spinlock_release(&slock);
 
-            if(as->allocated_pages == MAX_ALLOCATED_PAGES || (*paddr = getppages(1)) == 0) { //if I reached the max number of allocated pages or there is no free frame available, then I need to swap out a page before swap in.
+    if(i == SWAP_NONE) // I did't find the page in the swapfile: it can be in the compressed pool
+        return swap_in_compressed(as, pid, vaddr, paddr);
+
+    // the slot stays valid until it has been read, so a swap out done to free a frame cannot take it
+    *paddr = vm_get_user_frame(as, pid);
+    if(*paddr == 0)
+        return -1;
+    paddrs[0] = *paddr;
+
+    // clean the page just got by allocation (or previously swapped)
+    as_zero_region(*paddr, 1);
+    increment_page_faults_zeroed();
+
+    // a page swapped out all zero has just been rebuilt: its slot has nothing to keep
+    if (zero) {
+        spinlock_acquire(&slock);
+        status[0] = track[i].permission_flag == READ_ONLY ? SET_READONLY(0) : 0;
+        swap_index_remove(i);
+        spinlock_release(&slock);
+        page_table_add_entry(pid, vaddr, *paddr, status[0], PT_NO_SLOT);
+        increment_page_faults_swapin();
+        return 1;
+    }
 
-                index_page_to_replace = page_table_replacement(pid, &empty_entry); //find index victim to replace
+    // pages read ahead only take free frames, within the limit of the process
+    for(k=1; k<n; k++) {
+        if ((int)page_table_get_resident(pid) + k >= as->max_allocated_pages ||
+            (paddrs[k] = getppages(1)) == 0)
+            break;
+    }
+    n = k;
 
-                if(index_page_to_replace == -1)
-                    return 0;
+    // perform the I/O
+    swap_run_io(i, n, paddrs, UIO_READ);
 
-                swap_out(pid, empty_entry.vaddr, empty_entry.permission_flag, index_page_to_replace * PAGE_SIZE);
-                as->allocated_pages--; 
-                *paddr = index_page_to_replace*PAGE_SIZE;
+    // the slots are kept as the swap cache of the pages
+    spinlock_acquire(&slock);
+    for(k=0; k<n; k++) {
+        status[k] = track[i+k].permission_flag == READ_ONLY ? SET_READONLY(0) : 0;
+        track[i+k].valid = SLOT_CACHED;
+        swap_cached++;
+    }
+    spinlock_release(&slock);
 
-            }
+    // add the recently swapped-in page in the IPT
+    page_table_add_entry(pid, vaddr, *paddr, status[0], i);
+    increment_page_faults_swapin();
 
-            as->allocated_pages++; //increase number of allocated pages for that process
+    for(k=1; k<n; k++) {
+        page_table_add_entry(pid, vaddr + k*PAGE_SIZE, paddrs[k], SET_PREFETCHED(status[k]), i+k);
+        increment_swap_readahead_pages();
+    }
 
-            // clean the page just got by allocation (or previously swapped)
-            as_zero_region(*paddr, 1);
-            increment_page_faults_zeroed();
+    return 1;
+}
 
-            // perform the I/O
-            uio_kinit(&iov, &myuio, (void *)PADDR_TO_KVADDR(*paddr), PAGE_SIZE, i*PAGE_SIZE, UIO_READ);
-            if ((err = VOP_READ(swap_vnode, &myuio))) 
-                panic("[ERR] swapfile.c: read error %d\n",err);
+int swap_page_state(pid_t pid, vaddr_t vaddr) {
+    int i, state;
 
-            if (myuio.uio_resid!=0) // uio_resid is the amount of data left to transfer. If there is more, then error
-		        panic("[ERR] swapfile.c: uio_resid != 0\n");
+    spinlock_acquire(&slock);
+    i = swap_index_lookup(pid, vaddr);
+    state = i == SWAP_NONE ? SWAP_PAGE_NONE : track[i].valid == SLOT_ZERO ? SWAP_PAGE_ZERO : SWAP_PAGE_DATA;
+    spinlock_release(&slock);
 
-            track[i].pid = -1;
-            track[i].valid = 0;
-            
-            // add the recently swapped-in page in the IPT
-            page_table_add_entry(vaddr, *paddr, pid, track[*paddr/PAGE_SIZE].permission_flag);
-            increment_page_faults_swapin();
+    if (state == SWAP_PAGE_NONE && zswap_contains(pid, vaddr))
+        state = SWAP_PAGE_DATA;
+    return state;
+}
 
-            spinlock_release(&slock);
+void swap_cache_drop(pid_t pid, vaddr_t vaddr, int slot) {
+    spinlock_acquire(&slock);
+    if (track[slot].valid == SLOT_CACHED && track[slot].pid == pid && track[slot].vaddr == vaddr)
+        swap_index_remove(slot);
+    spinlock_release(&slock);
+}
 
-            return 1;
-        }
+void swap_readahead_feedback(int hit) {
+    spinlock_acquire(&ra_lock);
+    if (hit)
+        swap_ra_hits++;
+    if (++swap_ra_judged == SWAP_RA_PERIOD) {
+        if (swap_ra_hits * 4 >= SWAP_RA_PERIOD * 3)
+            swap_ra_window = swap_ra_window * 2 > SWAP_RA_MAX ? SWAP_RA_MAX : swap_ra_window * 2;
+        else if (swap_ra_hits * 4 < SWAP_RA_PERIOD && swap_ra_window > 1)
+            swap_ra_window /= 2;
+        swap_ra_hits = 0;
+        swap_ra_judged = 0;
     }
-    spinlock_release(&slock);
+    spinlock_release(&ra_lock);
 
-    if(i == NUMBERENTRIES) // I did't find the page to swap in into the ram
-        return 0;
+    if (hit)
+        increment_swap_readahead_hits();
+    else
+        increment_swap_readahead_wasted();
+}
 
-    return 1;
+unsigned int swap_get_readahead_window(void) {
+    return swap_ra_window;
+}
+
+void swap_ghost_add(pid_t pid, vaddr_t vaddr) {
+    int i, bucket;
+
+    spinlock_acquire(&ghost_lock);
+    i = ghost_next_slot;
+    ghost_next_slot = (ghost_next_slot + 1) % GHOSTENTRIES;
+    if (ghost[i].pid != -1)
+        ghost_unlink(i); // forget the oldest ghost
+
+    bucket = ghost_bucket(pid, vaddr);
+    ghost[i].pid = pid;
+    ghost[i].vaddr = vaddr;
+    ghost[i].next = ghost_hash[bucket];
+    ghost_hash[bucket] = i;
+    spinlock_release(&ghost_lock);
+}
+
+int swap_ghost_remove(pid_t pid, vaddr_t vaddr) {
+    int i;
+
+    spinlock_acquire(&ghost_lock);
+    for (i = ghost_hash[ghost_bucket(pid, vaddr)]; i != GHOST_NONE; i = ghost[i].next) {
+        if (ghost[i].pid == pid && ghost[i].vaddr == vaddr) {
+            ghost_unlink(i);
+            break;
+        }
+    }
+    spinlock_release(&ghost_lock);
+
+    return i != GHOST_NONE;
 }
 
 void swap_remove_pid(pid_t pid)
 {
     int i;
-    for(i=0; i<NUMBERENTRIES; i++) {
-        if(track[i].pid == pid && track[i].valid == 1) {
-            track[i].pid = -1;
-            track[i].valid = 0;
+
+    spinlock_acquire(&slock);
+    for(i=0; i<(int)swap_pages; i++) {
+        if(track[i].pid == pid && track[i].valid != SLOT_INVALID)
+            swap_index_remove(i);
+    }
+    spinlock_release(&slock);
+
+    zswap_remove_pid(pid);
+
+    spinlock_acquire(&ghost_lock);
+    for(i=0; i<GHOSTENTRIES; i++) {
+        if(ghost[i].pid == pid)
+            ghost_unlink(i);
+    }
+    spinlock_release(&ghost_lock);
+}
+
+int swap_set_size(unsigned int npages)
+{
+    swap_track *new_track, *old_track;
+    uint32_t *new_map, *old_map;
+    unsigned int i, old_pages;
+
+    if (npages < swap_pages)
+        return EINVAL; // the slots in use could be past the new end
+    if (npages > (size_t)-1 / sizeof(swap_track))
+        return ENOMEM; // the slot table would not fit in the address space
+
+    new_track = kmalloc(npages * sizeof(swap_track));
+    new_map = kmalloc(SWAP_MAP_WORDS(npages) * sizeof(uint32_t));
+    if (new_track == NULL || new_map == NULL) {
+        kfree(new_track);
+        kfree(new_map);
+        return ENOMEM;
+    }
+
+    spinlock_acquire(&slock);
+    old_pages = swap_pages;
+    old_track = track;
+    old_map = swap_map;
+    memcpy(new_track, track, swap_pages * sizeof(swap_track));
+    memcpy(new_map, swap_map, SWAP_MAP_WORDS(swap_pages) * sizeof(uint32_t));
+    for(i=swap_pages; i<npages; i++) {
+        new_track[i].permission_flag = 0;
+        new_track[i].pid = -1;
+        new_track[i].vaddr = 0;
+        new_track[i].valid = SLOT_INVALID;
+        new_track[i].next = SWAP_NONE;
+    }
+    track = new_track;
+    swap_map = new_map;
+    swap_pages = npages;
+    swap_map_init(old_pages);
+    spinlock_release(&slock);
+
+    kfree(old_track);
+    kfree(old_map);
+    return 0;
+}
+
+unsigned int swap_get_size(void)
+{
+    return swap_pages;
+}
+
+unsigned int swap_get_file_size(void)
+{
+    unsigned int d, pages = 0;
+
+    for(d=0; d<swap_ndevs; d++)
+        pages += swap_devs[d].pages;
+    return pages;
+}
+
+int swap_set_devices(int n, char **names)
+{
+    swap_dev devs[SWAP_MAX_DEVICES], old_devs[SWAP_MAX_DEVICES];
+    unsigned int old_ndevs;
+    int d, err;
+
+    if (n < 1 || n > SWAP_MAX_DEVICES)
+        return EINVAL;
+
+    for(d=0; d<n; d++) {
+        if ((err = swap_open(names[d], &devs[d]))) {
+            while (d-- > 0)
+                swap_close(&devs[d]);
+            return err;
         }
     }
+
+    lock_acquire(swap_grow_lock); // the old backends are not being extended
+    spinlock_acquire(&slock);
+    if (swap_used > 0) {
+        // the pages in the old backends would be lost, and the striping would change
+        spinlock_release(&slock);
+        lock_release(swap_grow_lock);
+        for(d=0; d<n; d++)
+            swap_close(&devs[d]);
+        return EBUSY;
+    }
+    old_ndevs = swap_ndevs;
+    memcpy(old_devs, swap_devs, sizeof(swap_devs));
+    memcpy(swap_devs, devs, n * sizeof(swap_dev));
+    swap_ndevs = n;
+    spinlock_release(&slock);
+    lock_release(swap_grow_lock);
+
+    for(d=0; d<(int)old_ndevs; d++)
+        swap_close(&old_devs[d]);
+    return 0;
+}
+
+void swap_print_devices(void)
+{
+    unsigned int d;
+
+    for(d=0; d<swap_ndevs; d++)
+        kprintf("%s (%s): %u pages\n", swap_devs[d].name, swap_devs[d].raw ? "raw" : "file", swap_devs[d].pages);
+}
+
+void swap_print_stats(void)
+{
+    unsigned int d;
+    swap_dev *dev;
+
+    kprintf("SWAP (%u backends):\nslots_used=%u, slots_cached=%u\n", swap_ndevs, swap_used, swap_cached);
+    for(d=0; d<swap_ndevs; d++) {
+        dev = &swap_devs[d];
+        kprintf("%s (%s): reads=%u (%u transfers), writes=%u (%u transfers), read_us_per_page=%lu, write_us_per_page=%lu, max_queue_depth=%u\n",
+            dev->name, dev->raw ? "raw" : "file", dev->reads, dev->read_ios, dev->writes, dev->write_ios,
+            dev->reads == 0 ? 0 : (unsigned long)(dev->read_ns / dev->reads / 1000),
+            dev->writes == 0 ? 0 : (unsigned long)(dev->write_ns / dev->writes / 1000),
+            dev->max_queued);
+    }
 }
 
 void swap_destroy(void)
 {
+	unsigned int d;
+
 	spinlock_cleanup(&slock);
-	vfs_close(swap_vnode);
+	lock_destroy(swap_grow_lock);
+	for(d=0; d<swap_ndevs; d++)
+		swap_close(&swap_devs[d]);
 }
@@ -1,6 +1,11 @@
 #include <types.h>
 #include <lib.h>
 #include <vm_stats.h>
+#include <pt.h>
+#include <swapfile.h>
+#include <pageout.h>
+#include <zswap.h>
+#include <coremap.h>
 
 static int tlb_faults = 0;
 static int tlb_faults_free = 0;
@@ -13,8 +18,30 @@ static int page_faults_elf = 0;
 static int page_faults_swapin = 0;
 static int page_faults_swapout = 0;
 static int swapfile_writes = 0;
+static int replacement_second_chances = 0;
+static int replacement_clean_victims = 0;
+static int replacement_dirty_victims = 0;
+static int pff_limit_grows = 0;
+static int pff_limit_shrinks = 0;
+static int pff_frames_released = 0;
+static int pff_limit[MAX_PROC+1]; // last limit set by the pff, by pid
+static int pff_limit_changes[MAX_PROC+1]; // times the limit of the pid has moved, 0 if never
+static int loadcontrol_suspensions = 0;
+static int loadcontrol_resumes = 0;
+static int loadcontrol_pages_swapped = 0;
+static int swap_readahead_pages = 0;
+static int swap_readahead_hits = 0;
+static int swap_readahead_wasted = 0;
+static int swap_writes_avoided = 0;
+static int swap_zero_pages = 0;
+static int swap_elf_discards = 0;
+static int zero_frame_mappings = 0;
+static int pageout_wakeups = 0;
+static int pageout_victims = 0;
 
 extern void init_stats(void) {
+    int i;
+
     tlb_faults = 0;
     tlb_faults_free = 0;
     tlb_faults_replace = 0;
@@ -26,6 +53,28 @@ extern void init_stats(void) {
     page_faults_swapin = 0;
     page_faults_swapout = 0;
     swapfile_writes = 0;
+    replacement_second_chances = 0;
+    replacement_clean_victims = 0;
+    replacement_dirty_victims = 0;
+    pff_limit_grows = 0;
+    pff_limit_shrinks = 0;
+    pff_frames_released = 0;
+    for (i = 0; i <= MAX_PROC; i++) {
+        pff_limit[i] = 0;
+        pff_limit_changes[i] = 0;
+    }
+    loadcontrol_suspensions = 0;
+    loadcontrol_resumes = 0;
+    loadcontrol_pages_swapped = 0;
+    swap_readahead_pages = 0;
+    swap_readahead_hits = 0;
+    swap_readahead_wasted = 0;
+    swap_writes_avoided = 0;
+    swap_zero_pages = 0;
+    swap_elf_discards = 0;
+    zero_frame_mappings = 0;
+    pageout_wakeups = 0;
+    pageout_victims = 0;
 }
 
 extern void increment_tlb_faults(void) {   //number of TLB misses occurred (not including faults that cause a program to crash). tlb_faults = tlb_faults_free + tlb_faults_replace = tlb_reloads + page_faults_disk + page_faults_zeroed;
@@ -83,8 +132,108 @@ extern void increment_swapfile_writes(void) {
     // kprintf("swapfile_writes=%d\n", swapfile_writes);
 }
 
+extern void increment_replacement_second_chances(void) {  //number of referenced pages skipped by the clock hand (reference bit cleared)
+    replacement_second_chances++;
+}
+
+extern void increment_replacement_clean_victims(void) {   //number of victims that were not written since they were loaded
+    replacement_clean_victims++;
+}
+
+extern void increment_replacement_dirty_victims(void) {   //number of victims that had been written
+    replacement_dirty_victims++;
+}
+
+extern void increment_pff_limit_grows(pid_t pid, int limit) {    //number of times the limit of resident pages of a process has been raised
+    pff_limit_grows++;
+    pff_limit[pid] = limit;
+    pff_limit_changes[pid]++;
+}
+
+extern void increment_pff_limit_shrinks(pid_t pid, int limit) {  //number of times the limit of resident pages of a process has been lowered
+    pff_limit_shrinks++;
+    pff_limit[pid] = limit;
+    pff_limit_changes[pid]++;
+}
+
+extern void increment_pff_frames_released(void) {    //number of frames given back to the free pool after a limit has been lowered
+    pff_frames_released++;
+}
+
+extern void increment_loadcontrol_suspensions(void) {    //number of processes suspended because the system was thrashing
+    loadcontrol_suspensions++;
+}
+
+extern void increment_loadcontrol_resumes(void) {    //number of suspended processes resumed
+    loadcontrol_resumes++;
+}
+
+extern void increment_loadcontrol_pages_swapped(void) {  //number of pages swapped out together with their suspended process
+    loadcontrol_pages_swapped++;
+}
+
+extern void increment_swap_readahead_pages(void) {    //number of pages read together with a swapped in page
+    swap_readahead_pages++;
+}
+
+extern void increment_swap_readahead_hits(void) {    //number of pages read ahead that were used before their eviction
+    swap_readahead_hits++;
+}
+
+extern void increment_swap_readahead_wasted(void) {    //number of pages read ahead that were evicted without being used
+    swap_readahead_wasted++;
+}
+
+extern void increment_swap_writes_avoided(void) {    //number of clean pages evicted without writing them, as their swap cache slot still held them
+    swap_writes_avoided++;
+}
+
+extern void increment_swap_zero_pages(void) {    //number of pages evicted all zero: they only took a slot, without being written
+    swap_zero_pages++;
+}
+
+extern void increment_swap_elf_discards(void) {    //number of clean pages read from the ELF file evicted by dropping them, without writing them
+    swap_elf_discards++;
+}
+
+extern void increment_zero_frame_mappings(void) {    //number of read faults on pages all zero served by mapping the shared zero frame
+    zero_frame_mappings++;
+}
+
+extern void increment_pageout_wakeups(void) {    //number of times the pageout daemon has been woken because the free frames were below the low watermark
+    pageout_wakeups++;
+}
+
+extern void increment_pageout_victims(void) {    //number of victims swapped out by the pageout daemon, each together with its cold neighbours
+    pageout_victims++;
+}
+
+extern int get_page_faults_disk(void) {
+    return page_faults_disk;
+}
+
 extern void print_all_statistics(void) {
+    int i;
+
     kprintf("STATISTICS:\ntlb_faults=%d, tlb_faults_free=%d, tlb_faults_replace=%d, tlb_invalidations=%d, tlb_reloads=%d, page_faults_zeroed=%d, page_faults_disk=%d, page_faults_elf=%d, page_faults_swapin=%d, page_faults_swapout=%d, swapfile_writes=%d\n", tlb_faults, tlb_faults_free, tlb_faults_replace, tlb_invalidations, tlb_reloads, page_faults_zeroed, page_faults_disk, page_faults_elf, page_faults_swapin, page_faults_swapout, swapfile_writes);
+    kprintf("REPLACEMENT (%s, %s):\nvictims=%d (clean=%d, dirty=%d), second_chances=%d, page_faults_swapin=%d, page_faults_swapout=%d\n", page_table_get_policy_name(), page_table_get_scope_name(), replacement_clean_victims + replacement_dirty_victims, replacement_clean_victims, replacement_dirty_victims, replacement_second_chances, page_faults_swapin, page_faults_swapout);
+    page_table_print_policy_stats();
+    kprintf("RESIDENT LIMITS (pff):\nlimit_grows=%d, limit_shrinks=%d, frames_released=%d\nlast limits (pid=limit/changes):", pff_limit_grows, pff_limit_shrinks, pff_frames_released);
+    for (i = 0; i <= MAX_PROC; i++) {
+        if (pff_limit_changes[i] > 0)
+            kprintf(" %d=%d/%d", i, pff_limit[i], pff_limit_changes[i]);
+    }
+    kprintf("\n");
+    kprintf("LOAD CONTROL:\nsuspensions=%d, resumes=%d, pages_swapped=%d\n", loadcontrol_suspensions, loadcontrol_resumes, loadcontrol_pages_swapped);
+    kprintf("READAHEAD (window %u):\npages=%d, hits=%d, wasted=%d\n", swap_get_readahead_window(), swap_readahead_pages, swap_readahead_hits, swap_readahead_wasted);
+    kprintf("SWAP CACHE:\nwrites_avoided=%d, elf_discards=%d\n", swap_writes_avoided, swap_elf_discards);
+    kprintf("ZERO PAGES:\nswapped_out=%d, zero_frame_mappings=%d\n", swap_zero_pages, zero_frame_mappings);
+    zswap_print_stats(page_faults_swapin);
+    coremap_print_stats();
+    kprintf("PAGEOUT (low %d, high %d):\nwakeups=%d, victims=%d\n", PAGEOUT_LOW, PAGEOUT_HIGH, pageout_wakeups, pageout_victims);
+    kprintf("PAGE TABLE LOCKS:\n");
+    page_table_print_lock_stats();
+    swap_print_stats();
     if( (tlb_faults_free + tlb_faults_replace) != tlb_faults)
         kprintf("Warning: TLB FAULTS with Free + TLB Faults with Replace is NOT equal to TLB Faults\n");
     
@@ -4,29 +4,48 @@
 #include <vm_stats.h>
 #include <mips/tlb.h> // here is the definition of NUM_TLB
 #include <spinlock.h>
+#include <synch.h>
+#include <cpu.h>
+#include <current.h>
+#include <platform/maxcpus.h>
 #include <vm.h> //here is the definition of PAGE_FRAME to remove the offset from the address
 
-unsigned char bitmap[NUM_TLB];
+/*
+ * Every cpu has a TLB of its own: the slots in use and the round robin victim are kept per
+ * cpu, indexed by curcpu->c_number, and only touched with slock held (so with interrupts off,
+ * on the same cpu). An entry dropped because its page is going away is dropped on the other
+ * cpus too, with a shootdown: see reset_one_entry_by_vaddr() and tlb_shootdown_wait().
+ */
+static unsigned char bitmap[MAXCPUS][NUM_TLB];
+static unsigned int next_victim[MAXCPUS];
 
 static struct spinlock slock = SPINLOCK_INITIALIZER;
 
+static struct lock *shootdown_lock; // one tlb_shootdown_wait() at a time
+static struct semaphore *shootdown_done; // acknowledgements of the other cpus
+
 void tlb_bootstrap(void) {
-    int index;
-    for(index=0;index<NUM_TLB;index++) {
-        bitmap[index] = 0;
+    int cpu, index;
+    for(cpu=0;cpu<MAXCPUS;cpu++) {
+        for(index=0;index<NUM_TLB;index++)
+            bitmap[cpu][index] = 0;
+        next_victim[cpu] = 0;
     }
+    shootdown_lock = lock_create("tlb_shootdown");
+    shootdown_done = sem_create("tlb_shootdown", 0);
+    if (shootdown_lock == NULL || shootdown_done == NULL)
+        panic("[ERR] vm_tlb.c: error creating the shootdown synchronization\n");
 }
 
 static int tlb_get_rr_victim(void) { //select victim inside TLB when there is no space
     int victim;
-    static unsigned int next_victim = 0;
-    victim = next_victim;
-    next_victim = (next_victim + 1) % NUM_TLB;
+    victim = next_victim[curcpu->c_number];
+    next_victim[curcpu->c_number] = (victim + 1) % NUM_TLB;
     return victim;
 }
 
 void write_entry(int index, uint32_t vaddr_no_offset_with_pid, uint32_t paddr_with_flags) {
-    bitmap[index] = 1;
+    bitmap[curcpu->c_number][index] = 1;
     tlb_write(vaddr_no_offset_with_pid, paddr_with_flags, index); //set to 0 the last 8 bits
 }
 
@@ -38,7 +57,7 @@ void add_entry(int *index_tlb, uint32_t vaddr_no_offset_with_pid, uint32_t paddr
     spinlock_acquire(&slock);
     if(*index_tlb == -1) {
         for(index=0; index<NUM_TLB; index++) {
-            if(bitmap[index] == 0) {
+            if(bitmap[curcpu->c_number][index] == 0) {
                 increment_tlb_faults_free();
                 break;
             }
@@ -68,8 +87,10 @@ int read_entry(uint32_t vaddr, uint32_t *paddr) {
 
     int index = tlb_probe(vaddr_no_offset, *paddr);     // tlb_probe looks for a match with vaddr and returns the index
                                                         // paddr must be set but not used by tlb_probe
-    if(index < 0)
+    if(index < 0) {
+        spinlock_release(&slock);
         return -1;
+    }
     
     tlb_read(NULL, &paddr_tmp, index);
     *paddr = paddr_tmp | offset;
@@ -81,25 +102,105 @@ int read_entry(uint32_t vaddr, uint32_t *paddr) {
 void reset_one_entry_by_index(int index) {
     spinlock_acquire(&slock);
 
-    bitmap[index]=0;
+    bitmap[curcpu->c_number][index]=0;
     tlb_write(TLBHI_INVALID(index), TLBLO_INVALID(),index);
 
     spinlock_release(&slock);
 }
 
-void reset_tlb(void) {
+// drop the entry mapping vaddr (page number and pid) from the TLB of this cpu. slock must be held
+static void tlb_drop(uint32_t vaddr_no_offset_with_pid) {
     int index;
 
-    spinlock_acquire(&slock);
+    index = tlb_probe(vaddr_no_offset_with_pid, 0);
+    if(index >= 0) {
+        bitmap[curcpu->c_number][index]=0;
+        tlb_write(TLBHI_INVALID(index), TLBLO_INVALID(),index);
+    }
+}
+
+// empty the TLB of this cpu. slock must be held
+static void tlb_drop_all(void) {
+    int index;
 
     for(index=0;index<NUM_TLB;index++) {
-        bitmap[index]=0;
+        bitmap[curcpu->c_number][index]=0;
         tlb_write(TLBHI_INVALID(index), TLBLO_INVALID(),index);
     }
+}
+
+// have the other cpus drop the entry mapping vaddr, or all their entries for TLBSHOOTDOWN_ALL
+static void tlb_shootdown(uint32_t vaddr_no_offset_with_pid) {
+    struct tlbshootdown ts;
+
+    ts.ts_entryhi = vaddr_no_offset_with_pid;
+    ts.ts_done = NULL;
+    ipi_tlbshootdown_broadcast(&ts);
+}
+
+/*
+ * Invalidate the entry mapping vaddr (page number and pid), if it is in the TLB. The pid is
+ * the one of the owner of the page, so it also drops the pages of other processes taken by
+ * global replacement or by the pageout daemon. The owner may have run on other cpus, so they
+ * drop it as well at their next interrupt: tlb_shootdown_wait() waits for that. It can be
+ * called holding spinlocks.
+ */
+void reset_one_entry_by_vaddr(uint32_t vaddr_no_offset_with_pid) {
+    spinlock_acquire(&slock);
+    tlb_drop(vaddr_no_offset_with_pid);
+    spinlock_release(&slock);
+
+    tlb_shootdown(vaddr_no_offset_with_pid);
+}
+
+void reset_tlb(void) {
+    spinlock_acquire(&slock);
+
+    tlb_drop_all();
 
     increment_tlb_invalidations();
 
     spinlock_release(&slock);
+
+    // the entries of the process may also be on the cpus it ran on before
+    tlb_shootdown(TLBSHOOTDOWN_ALL);
+}
+
+/*
+ * Wait until the other cpus have run the shootdowns sent to them so far, so that none of
+ * them maps the pages dropped before the call any more. Must be able to sleep: called before
+ * the pages being evicted are written out, and before the frames of a process are reused.
+ */
+void tlb_shootdown_wait(void) {
+    struct tlbshootdown ts;
+    unsigned int n;
+
+    ts.ts_entryhi = TLBSHOOTDOWN_ALL;
+    ts.ts_done = shootdown_done;
+
+    lock_acquire(shootdown_lock);
+    // shootdowns run in order on each cpu: the acknowledgement comes after the ones sent before
+    for (n = ipi_tlbshootdown_broadcast(&ts); n > 0; n--)
+        P(shootdown_done);
+    lock_release(shootdown_lock);
+}
+
+/*
+ * Called on the target cpu of a shootdown, from the interprocessor interrupt (see
+ * interprocessor_interrupt() in thread.c), with interrupts off.
+ */
+void vm_tlbshootdown(const struct tlbshootdown *ts) {
+    if (ts->ts_done != NULL) {
+        V(ts->ts_done);
+        return;
+    }
+
+    spinlock_acquire(&slock);
+    if (ts->ts_entryhi == TLBSHOOTDOWN_ALL)
+        tlb_drop_all();
+    else
+        tlb_drop(ts->ts_entryhi);
+    spinlock_release(&slock);
 }
 
 void reset_tlb_pid_different(pid_t current_pid) {
@@ -116,8 +217,11 @@ void reset_tlb_pid_different(pid_t current_pid) {
 		tmp_pid_tlb = (vaddr & TLBHI_PID) >> 6;
 		if (tmp_pid_tlb == current_pid)
             every_entry_has_pid_different = false;
-		else
-			reset_one_entry_by_index(index);
+		else {
+			// slock is already held: reset_one_entry_by_index() would take it again
+			bitmap[curcpu->c_number][index]=0;
+			tlb_write(TLBHI_INVALID(index), TLBLO_INVALID(),index);
+		}
 	}
 	if (every_entry_has_pid_different)
 		increment_tlb_invalidations();
@@ -0,0 +1,502 @@
+#include <types.h>
+#include <lib.h>
+#include <vm.h>
+#include <synch.h>
+#include <pt.h>
+#include <kern/errno.h>
+#include <coremap.h>
+#include <pageout.h>
+#include <zswap.h>
+
+#define ZSWAP_BUCKETS 256 // power of 2
+#define ZSWAP_NONE -1
+#define ZSWAP_MIN_MATCH 3
+#define ZSWAP_MAX_MATCH (0x7f + ZSWAP_MIN_MATCH)
+#define ZSWAP_MAX_LITERALS 0x80
+#define ZSWAP_HASH_BITS 10
+
+/*
+ * Codec: LZ77 with a single hash table of the last position of every 3-byte prefix, greedy
+ * matching. The output is a sequence of tokens:
+ *  - 0xxxxxxx: x+1 literal bytes follow;
+ *  - 1xxxxxxx: copy x+3 bytes from the offset (1 to PAGE_SIZE-1) in the 2 bytes that follow.
+ */
+
+typedef struct zswap_entry {
+    pid_t pid; // -1 if the entry is free
+    vaddr_t vaddr;
+    permission_t permission_flag;
+    unsigned int frame; // frame of the pool holding the page
+    unsigned int chunk; // first chunk, in the frame
+    unsigned int nchunks;
+    unsigned int len; // compressed size in bytes
+    int next; // next entry in the same bucket, or in the free list
+} zswap_entry;
+
+static paddr_t *zswap_frames; // frames of the pool, 0 for the slots not holding one yet
+static uint32_t *zswap_chunk_map; // for every frame of the pool, one bit per chunk, set if it is used
+static unsigned int zswap_max_frames = 0; // slots of the pool: the most frames it can take, 0 if it is disabled
+static unsigned int zswap_nframes = 0; // frames taken
+static zswap_entry *zswap_entries = NULL; // grown with the pages stored, up to one per chunk
+static unsigned int zswap_nentries = 0;
+static int zswap_free = ZSWAP_NONE; // free list of the entries
+static int zswap_hash[ZSWAP_BUCKETS];
+static struct lock *zswap_lock; // protects all of the above, and the buffers of the codec
+
+static unsigned char zswap_buf[ZSWAP_MAX_LEN];
+static uint16_t zswap_htab[1 << ZSWAP_HASH_BITS]; // position + 1 of the last occurrence of a prefix, 0 if none
+
+static unsigned int zswap_stored = 0; // pages in the pool
+static unsigned int zswap_stores = 0, zswap_rejected = 0, zswap_full = 0, zswap_loads = 0, zswap_released = 0;
+static uint64_t zswap_bytes_in = 0, zswap_bytes_out = 0; // of the pages stored, before and after compression
+
+static unsigned int zswap_hash3(const unsigned char *p) {
+    return ((uint32_t)(p[0] << 16 | p[1] << 8 | p[2]) * 2654435761u) >> (32 - ZSWAP_HASH_BITS);
+}
+
+static int zswap_bucket(pid_t pid, vaddr_t vaddr) {
+    return ((vaddr / PAGE_SIZE) ^ ((uint32_t)pid * 0x9e3779b1)) & (ZSWAP_BUCKETS - 1);
+}
+
+// append the literals src[from..to) to dst. Returns the new output length, -1 if it goes over max
+static int zswap_put_literals(const unsigned char *src, size_t from, size_t to, unsigned char *dst, int op, size_t max) {
+    size_t n;
+
+    while (from < to) {
+        n = to - from > ZSWAP_MAX_LITERALS ? ZSWAP_MAX_LITERALS : to - from;
+        if (op + 1 + n > max)
+            return -1;
+        dst[op++] = n - 1;
+        memcpy(dst + op, src + from, n);
+        op += n;
+        from += n;
+    }
+    return op;
+}
+
+// compress a page into at most max bytes of dst. Returns the compressed length, -1 if it does not fit
+static int zswap_compress(const unsigned char *src, unsigned char *dst, size_t max) {
+    size_t ip = 0, lit = 0, cand, len;
+    unsigned int h;
+    int op = 0;
+
+    bzero(zswap_htab, sizeof(zswap_htab));
+    while (ip + ZSWAP_MIN_MATCH <= PAGE_SIZE) {
+        h = zswap_hash3(src + ip);
+        cand = zswap_htab[h];
+        zswap_htab[h] = ip + 1;
+        // the hash only says that the prefix may be the same
+        if (cand-- == 0 || src[cand] != src[ip] || src[cand + 1] != src[ip + 1] || src[cand + 2] != src[ip + 2]) {
+            ip++;
+            continue;
+        }
+        for (len = ZSWAP_MIN_MATCH; ip + len < PAGE_SIZE && len < ZSWAP_MAX_MATCH && src[cand + len] == src[ip + len]; len++);
+
+        if ((op = zswap_put_literals(src, lit, ip, dst, op, max)) < 0 || op + 3 > (int)max)
+            return -1;
+        dst[op++] = 0x80 | (len - ZSWAP_MIN_MATCH);
+        dst[op++] = (ip - cand) & 0xff;
+        dst[op++] = (ip - cand) >> 8;
+        ip += len;
+        lit = ip;
+    }
+    return zswap_put_literals(src, lit, PAGE_SIZE, dst, op, max);
+}
+
+// decompress len bytes of src into a page. 0, or -1 if they are not a valid compressed page
+static int zswap_decompress(const unsigned char *src, size_t len, unsigned char *dst) {
+    size_t ip = 0, op = 0, n, off;
+
+    while (ip < len) {
+        if (src[ip] & 0x80) {
+            if (ip + 3 > len)
+                return -1;
+            n = (src[ip] & 0x7f) + ZSWAP_MIN_MATCH;
+            off = src[ip + 1] | src[ip + 2] << 8;
+            ip += 3;
+            if (off == 0 || off > op || op + n > PAGE_SIZE)
+                return -1;
+            for (; n > 0; n--, op++)
+                dst[op] = dst[op - off]; // the copy can overlap what it writes
+        }
+        else {
+            n = src[ip++] + 1;
+            if (ip + n > len || op + n > PAGE_SIZE)
+                return -1;
+            memcpy(dst + op, src + ip, n);
+            ip += n;
+            op += n;
+        }
+    }
+    return op == PAGE_SIZE ? 0 : -1;
+}
+
+// bits of n consecutive chunks, starting from the first one
+static uint32_t zswap_chunk_mask(unsigned int n) {
+    return n == 32 ? 0xffffffff : (1u << n) - 1;
+}
+
+// first of n consecutive free chunks in frame f of the pool, -1 if there are none
+static int zswap_chunk_find(unsigned int f, unsigned int n) {
+    uint32_t mask = zswap_chunk_mask(n);
+    unsigned int c;
+
+    for (c = 0; c + n <= 32; c++) {
+        if ((zswap_chunk_map[f] & (mask << c)) == 0)
+            return c;
+    }
+    return -1;
+}
+
+// entry of the page (pid, vaddr), ZSWAP_NONE if it is not in the pool. zswap_lock must be held
+static int zswap_lookup(pid_t pid, vaddr_t vaddr) {
+    int i;
+
+    for (i = zswap_hash[zswap_bucket(pid, vaddr)]; i != ZSWAP_NONE; i = zswap_entries[i].next) {
+        if (zswap_entries[i].pid == pid && zswap_entries[i].vaddr == vaddr)
+            break;
+    }
+    return i;
+}
+
+// unlink entry i, give its chunks back and put it in the free list. zswap_lock must be held
+static void zswap_drop(int i) {
+    zswap_entry *e = &zswap_entries[i];
+    int *link = &zswap_hash[zswap_bucket(e->pid, e->vaddr)];
+
+    while (*link != ZSWAP_NONE) {
+        if (*link == i) {
+            *link = e->next;
+            break;
+        }
+        link = &zswap_entries[*link].next;
+    }
+    // the frame stays in the pool even if it is left empty, until zswap_shrink() takes it back
+    zswap_chunk_map[e->frame] &= ~(zswap_chunk_mask(e->nchunks) << e->chunk);
+    e->pid = -1;
+    e->next = zswap_free;
+    zswap_free = i;
+    zswap_stored--;
+}
+
+/*
+ * Take a frame for slot f of the pool, unless the free frames are running out: it would only
+ * be taken back by the pageout daemon. 0, or -1 if there is none. zswap_lock must be held
+ */
+static int zswap_frame_add(unsigned int f) {
+    if (coremap_free_frames_below(PAGEOUT_LOW))
+        return -1;
+    zswap_frames[f] = getppages(1);
+    if (zswap_frames[f] == 0)
+        return -1;
+    zswap_chunk_map[f] = 0;
+    zswap_nframes++;
+    return 0;
+}
+
+// give the empty frame in slot f of the pool back to the free pool. zswap_lock must be held
+static void zswap_frame_release(unsigned int f) {
+    KASSERT(zswap_chunk_map[f] == 0);
+    freeppages(zswap_frames[f]);
+    zswap_frames[f] = 0;
+    zswap_nframes--;
+    zswap_released++;
+}
+
+// double the entries, up to one per chunk of the pool. 0, or -1 if it cannot. zswap_lock must be held
+static int zswap_entries_grow(void) {
+    unsigned int n = zswap_nentries == 0 ? 32 : zswap_nentries * 2;
+    zswap_entry *entries;
+    int i;
+
+    if (n > zswap_max_frames * 32)
+        n = zswap_max_frames * 32;
+    if (n <= zswap_nentries)
+        return -1;
+    entries = kmalloc(n * sizeof(zswap_entry));
+    if (entries == NULL)
+        return -1;
+
+    // the hash chains and the free list link entries by index, so they can be moved as they are
+    memcpy(entries, zswap_entries, zswap_nentries * sizeof(zswap_entry));
+    for (i = n - 1; i >= (int)zswap_nentries; i--) {
+        entries[i].pid = -1;
+        entries[i].next = zswap_free;
+        zswap_free = i;
+    }
+    kfree(zswap_entries);
+    zswap_entries = entries;
+    zswap_nentries = n;
+    return 0;
+}
+
+/*
+ * Move the pages in frame f of the pool to the free chunks of the frames in the slots below
+ * limit, without decompressing them. 0 if f is left empty. zswap_lock must be held
+ */
+static int zswap_evacuate(unsigned int f, unsigned int limit) {
+    zswap_entry *e;
+    unsigned int i, g;
+    int c = -1;
+
+    for (i = 0; i < zswap_nentries && zswap_chunk_map[f] != 0; i++) {
+        e = &zswap_entries[i];
+        if (e->pid == -1 || e->frame != f)
+            continue;
+        for (g = 0; g < limit; g++) {
+            if (g != f && zswap_frames[g] != 0 && (c = zswap_chunk_find(g, e->nchunks)) >= 0)
+                break;
+        }
+        if (g == limit)
+            return -1;
+        memcpy((void *)(PADDR_TO_KVADDR(zswap_frames[g]) + c * ZSWAP_CHUNK),
+            (const void *)(PADDR_TO_KVADDR(zswap_frames[f]) + e->chunk * ZSWAP_CHUNK), e->len);
+        zswap_chunk_map[g] |= zswap_chunk_mask(e->nchunks) << c;
+        zswap_chunk_map[f] &= ~(zswap_chunk_mask(e->nchunks) << e->chunk);
+        e->frame = g;
+        e->chunk = c;
+    }
+    return zswap_chunk_map[f] == 0 ? 0 : -1;
+}
+
+/*
+ * Set the most frames the pool can take, 0 to disable it. The frames are taken as the pages
+ * are stored. The frames in the slots past the new size are given back, after moving their
+ * pages to the ones below it: EBUSY if they don't fit.
+ */
+int zswap_set_size(unsigned int nframes) {
+    paddr_t *frames = NULL, *old_frames;
+    uint32_t *chunk_map = NULL, *old_chunk_map;
+    unsigned int f;
+
+    if (nframes > coremap_get_nframes())
+        return EINVAL;
+    if (nframes > 0) {
+        frames = kmalloc(nframes * sizeof(paddr_t));
+        chunk_map = kmalloc(nframes * sizeof(uint32_t));
+        if (frames == NULL || chunk_map == NULL) {
+            kfree(frames);
+            kfree(chunk_map);
+            return ENOMEM;
+        }
+    }
+
+    lock_acquire(zswap_lock);
+    for (f = nframes; f < zswap_max_frames; f++) {
+        if (zswap_frames[f] != 0 && zswap_evacuate(f, nframes) != 0) {
+            lock_release(zswap_lock);
+            kfree(frames);
+            kfree(chunk_map);
+            return EBUSY;
+        }
+    }
+    for (f = 0; f < nframes; f++) {
+        frames[f] = f < zswap_max_frames ? zswap_frames[f] : 0;
+        chunk_map[f] = f < zswap_max_frames ? zswap_chunk_map[f] : 0;
+    }
+    for (f = nframes; f < zswap_max_frames; f++) {
+        if (zswap_frames[f] != 0)
+            zswap_frame_release(f);
+    }
+    old_frames = zswap_frames;
+    old_chunk_map = zswap_chunk_map;
+    zswap_frames = frames;
+    zswap_chunk_map = chunk_map;
+    zswap_max_frames = nframes;
+    if (nframes == 0) {
+        // nothing can be stored any more: the entries go too
+        KASSERT(zswap_stored == 0);
+        kfree(zswap_entries);
+        zswap_entries = NULL;
+        zswap_nentries = 0;
+        zswap_free = ZSWAP_NONE;
+    }
+    lock_release(zswap_lock);
+
+    kfree(old_frames);
+    kfree(old_chunk_map);
+    return 0;
+}
+
+unsigned int zswap_get_size(void) {
+    return zswap_max_frames;
+}
+
+unsigned int zswap_get_frames(void) {
+    return zswap_nframes;
+}
+
+/*
+ * Called by the pageout daemon when the free frames run low: give back up to n frames of the
+ * pool, packing the pages of the last frames into the room left in the first ones. Returns
+ * the number of frames given back.
+ */
+unsigned int zswap_shrink(unsigned int n) {
+    unsigned int f, released = 0;
+
+    if (zswap_nframes == 0)
+        return 0;
+
+    lock_acquire(zswap_lock);
+    for (f = zswap_max_frames; f-- > 0 && released < n; ) {
+        if (zswap_frames[f] != 0 && zswap_evacuate(f, f) == 0) {
+            zswap_frame_release(f);
+            released++;
+        }
+    }
+    lock_release(zswap_lock);
+
+    return released;
+}
+
+void zswap_bootstrap(void) {
+    int i;
+
+    KASSERT(PAGE_SIZE / ZSWAP_CHUNK == 32);
+
+    zswap_lock = lock_create("zswap_lock");
+    if (zswap_lock == NULL)
+        panic("[ERR] zswap.c: cannot create the lock\n");
+    for (i = 0; i < ZSWAP_BUCKETS; i++)
+        zswap_hash[i] = ZSWAP_NONE;
+
+    // no frame is taken until a page is stored
+    if (zswap_set_size(coremap_get_nframes() * ZSWAP_POOL_PERCENT / 100))
+        panic("[ERR] zswap.c: cannot allocate the pool\n");
+}
+
+int zswap_store(const entry_t *page, paddr_t paddr) {
+    zswap_entry *e;
+    unsigned int f, nchunks;
+    int len, c = -1, i;
+
+    if (zswap_max_frames == 0)
+        return -1;
+
+    lock_acquire(zswap_lock);
+    zswap_stores++;
+    len = zswap_compress((const unsigned char *)PADDR_TO_KVADDR(paddr), zswap_buf, ZSWAP_MAX_LEN);
+    if (len < 0) {
+        zswap_rejected++;
+        lock_release(zswap_lock);
+        return -1;
+    }
+
+    // room in a frame of the pool, or in a new one if it can still grow
+    nchunks = (len + ZSWAP_CHUNK - 1) / ZSWAP_CHUNK;
+    for (f = 0; f < zswap_max_frames; f++) {
+        if (zswap_frames[f] != 0 && (c = zswap_chunk_find(f, nchunks)) >= 0)
+            break;
+    }
+    if (c < 0) {
+        for (f = 0; f < zswap_max_frames && zswap_frames[f] != 0; f++);
+        if (f < zswap_max_frames && zswap_frame_add(f) == 0)
+            c = 0;
+    }
+    if (c >= 0 && zswap_free == ZSWAP_NONE && zswap_entries_grow() != 0)
+        c = -1;
+    if (c < 0) {
+        zswap_full++;
+        lock_release(zswap_lock);
+        return -1;
+    }
+
+    // a copy left by an earlier eviction would be found first and is out of date
+    if ((i = zswap_lookup(page->pid, page->vaddr)) != ZSWAP_NONE)
+        zswap_drop(i);
+
+    i = zswap_free;
+    e = &zswap_entries[i];
+    zswap_free = e->next;
+    e->pid = page->pid;
+    e->vaddr = page->vaddr;
+    e->permission_flag = page->permission_flag;
+    e->frame = f;
+    e->chunk = c;
+    e->nchunks = nchunks;
+    e->len = len;
+    zswap_chunk_map[f] |= zswap_chunk_mask(nchunks) << c;
+    memcpy((void *)(PADDR_TO_KVADDR(zswap_frames[f]) + c * ZSWAP_CHUNK), zswap_buf, len);
+
+    e->next = zswap_hash[zswap_bucket(e->pid, e->vaddr)];
+    zswap_hash[zswap_bucket(e->pid, e->vaddr)] = i;
+    zswap_stored++;
+    zswap_bytes_in += PAGE_SIZE;
+    zswap_bytes_out += len;
+    lock_release(zswap_lock);
+
+    return 0;
+}
+
+int zswap_contains(pid_t pid, vaddr_t vaddr) {
+    int found;
+
+    if (zswap_stored == 0)
+        return 0;
+
+    lock_acquire(zswap_lock);
+    found = zswap_lookup(pid, vaddr) != ZSWAP_NONE;
+    lock_release(zswap_lock);
+
+    return found;
+}
+
+int zswap_load(pid_t pid, vaddr_t vaddr, paddr_t paddr, permission_t *permission_flag) {
+    zswap_entry *e;
+    int i, result;
+
+    if (zswap_stored == 0)
+        return -1;
+
+    lock_acquire(zswap_lock);
+    i = zswap_lookup(pid, vaddr);
+    if (i == ZSWAP_NONE) {
+        lock_release(zswap_lock);
+        return -1;
+    }
+    e = &zswap_entries[i];
+    result = zswap_decompress((const unsigned char *)(PADDR_TO_KVADDR(zswap_frames[e->frame]) + e->chunk * ZSWAP_CHUNK),
+        e->len, (unsigned char *)PADDR_TO_KVADDR(paddr));
+    if (result)
+        panic("[ERR] zswap.c: corrupted page in the pool\n");
+    *permission_flag = e->permission_flag;
+    zswap_drop(i);
+    zswap_loads++;
+    lock_release(zswap_lock);
+
+    return 0;
+}
+
+void zswap_remove(pid_t pid, vaddr_t vaddr) {
+    int i;
+
+    if (zswap_stored == 0)
+        return;
+
+    lock_acquire(zswap_lock);
+    if ((i = zswap_lookup(pid, vaddr)) != ZSWAP_NONE)
+        zswap_drop(i);
+    lock_release(zswap_lock);
+}
+
+void zswap_remove_pid(pid_t pid) {
+    unsigned int i;
+
+    if (zswap_stored == 0)
+        return;
+
+    lock_acquire(zswap_lock);
+    for (i = 0; i < zswap_nentries; i++) {
+        if (zswap_entries[i].pid == pid)
+            zswap_drop(i);
+    }
+    lock_release(zswap_lock);
+}
+
+void zswap_print_stats(int swapins) {
+    unsigned int ratio = zswap_bytes_out == 0 ? 0 : (unsigned int)(zswap_bytes_in * 100 / zswap_bytes_out);
+
+    kprintf("ZSWAP (%u of %u frames):\nstored=%u, stores=%u, rejected=%u, pool_full=%u, loads=%u, released=%u, ratio=%u.%02u, hit_rate=%d%%\n",
+        zswap_nframes, zswap_max_frames, zswap_stored, zswap_stores, zswap_rejected, zswap_full, zswap_loads, zswap_released,
+        ratio / 100, ratio % 100, swapins == 0 ? 0 : (int)(zswap_loads * 100 / swapins));
+}